@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <ankerl/unordered_dense.h>
+
+// Thread-safe cache which keeps the total size of its values within a budget, evicting values with the CLOCK policy
+// Keys are spread over shards with their own lock, values are loaded outside the lock so that a slow load never blocks
+// other threads, and values are handed out as shared pointers so that evicting them doesn't invalidate them for readers
+template<typename Value>
+class ConcurrentCache {
+    static constexpr std::size_t SHARD_COUNT = 64;
+
+    // Rough size of a slot and its map entry, so that many tiny values still count towards the budget
+    static constexpr std::uint64_t ENTRY_OVERHEAD = 64;
+
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const Value> value;
+        std::uint64_t size = 0;
+        bool referenced = false;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        ankerl::unordered_dense::map<std::string, std::size_t> slots;
+        std::vector<Entry> entries;
+        std::vector<std::size_t> freeSlots;
+        std::size_t hand = 0;
+        std::uint64_t size = 0;
+    };
+
+    std::uint64_t shardLimit;
+    std::vector<Shard> shards;
+
+public:
+    explicit ConcurrentCache(std::uint64_t limit)
+        : shardLimit(limit / SHARD_COUNT), shards(SHARD_COUNT) {}
+
+    // Returns the cached value of the key, or calls load() and caches its result when there is none
+    // getSize() returns the number of bytes a value occupies
+    template<typename Load, typename GetSize>
+    std::shared_ptr<const Value> get(const std::string& key, Load&& load, GetSize&& getSize) {
+        auto& shard = shards[ankerl::unordered_dense::hash<std::string>{}(key) % SHARD_COUNT];
+
+        {
+            std::lock_guard lock(shard.mutex);
+
+            auto it = shard.slots.find(key);
+            if (it != shard.slots.end()) {
+                auto& entry = shard.entries[it->second];
+                entry.referenced = true;
+                return entry.value;
+            }
+        }
+
+        auto value = std::make_shared<const Value>(load());
+        auto size = getSize(*value) + key.size() + ENTRY_OVERHEAD;
+
+        std::lock_guard lock(shard.mutex);
+
+        // Another thread may have loaded the same key in the meantime
+        auto it = shard.slots.find(key);
+        if (it != shard.slots.end()) {
+            auto& entry = shard.entries[it->second];
+            entry.referenced = true;
+            return entry.value;
+        }
+
+        while (shard.size + size > shardLimit && shard.slots.size() > 0) {
+            evict(shard);
+        }
+
+        std::size_t slot;
+        if (!shard.freeSlots.empty()) {
+            slot = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        } else {
+            slot = shard.entries.size();
+            shard.entries.emplace_back();
+        }
+
+        shard.entries[slot] = {key, value, size, false};
+        shard.slots.emplace(key, slot);
+        shard.size += size;
+
+        return value;
+    }
+
+private:
+    // Advances the clock hand until it finds an entry which hasn't been referenced since the hand last passed it
+    static void evict(Shard& shard) {
+        while (true) {
+            auto& entry = shard.entries[shard.hand];
+            shard.hand = (shard.hand + 1) % shard.entries.size();
+
+            if (entry.value == nullptr) {
+                continue;
+            }
+
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+
+            shard.slots.erase(entry.key);
+            shard.freeSlots.emplace_back(&entry - shard.entries.data());
+            shard.size -= entry.size;
+
+            entry = {};
+            return;
+        }
+    }
+};
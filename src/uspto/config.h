@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <string>
@@ -64,6 +65,30 @@ inline std::filesystem::path getReformattedPatentDataDirectory() {
     return getOutputDirectory() / "patents";
 }
 
+// Upper bound for the memory used to hold patent data while reformatting it, in bytes
+inline std::uint64_t getReformatMemoryLimit() {
+    const char* value = std::getenv("REFORMAT_MEMORY_LIMIT_GB");
+    std::uint64_t gigabytes = value != nullptr ? std::stoull(value) : 8;
+
+    return gigabytes * 1024 * 1024 * 1024;
+}
+
+// Upper bound for the memory used to buffer postings while building a search index, in bytes
+inline std::uint64_t getIndexMemoryLimit() {
+    const char* value = std::getenv("INDEX_MEMORY_LIMIT_GB");
+    std::uint64_t gigabytes = value != nullptr ? std::stoull(value) : 8;
+
+    return gigabytes * 1024 * 1024 * 1024;
+}
+
+// Upper bound for the memory used to cache bitsets, counts and cardinalities read from the search index, in bytes
+inline std::uint64_t getSearchIndexCacheLimit() {
+    const char* value = std::getenv("SEARCH_INDEX_CACHE_LIMIT_GB");
+    std::uint64_t gigabytes = value != nullptr ? std::stoull(value) : 4;
+
+    return gigabytes * 1024 * 1024 * 1024;
+}
+
 inline std::filesystem::path getValidationIndexDirectory() {
     if (IS_KAGGLE) {
         spdlog::error("getValidationIndexDirectory() is not supported when running on Kaggle");
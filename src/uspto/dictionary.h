@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <ankerl/unordered_dense.h>
+
+#include <uspto/files.h>
+
+// Maps every "<category>:<token>" term to a dense uint32 id
+// data.bin contains a uint64 offset per id followed by the uint16 length-prefixed terms, ordered by id
+// index.bin is a key index mapping every term to its id
+class TermDictionary {
+    KeyIndex<std::uint16_t> index;
+    std::shared_ptr<MappedFile> terms;
+
+public:
+    explicit TermDictionary(const std::filesystem::path& directory)
+        : index(directory / "index.bin"),
+          terms(std::make_shared<MappedFile>(directory / "data.bin")) {}
+
+    std::uint32_t size() const {
+        return index.size();
+    }
+
+    bool contains(std::string_view term) const {
+        return index.contains(term);
+    }
+
+    std::uint32_t getId(std::string_view term) const {
+        return index.at(term);
+    }
+
+    std::string_view getTerm(std::uint32_t id) const {
+        MemoryReader reader(terms->getData(), terms->getSize(), static_cast<std::uint64_t>(id) * 8);
+        reader.seek(reader.readScalar<std::uint64_t>());
+        return reader.readStringView<std::uint16_t>();
+    }
+};
+
+// Assigns ids on first sight, safe to share between writers running on different threads
+class TermDictionaryWriter {
+    struct StringHash {
+        using is_transparent = void;
+        using is_avalanching = void;
+
+        std::uint64_t operator()(std::string_view str) const noexcept {
+            return ankerl::unordered_dense::hash<std::string_view>{}(str);
+        }
+    };
+
+    // Terms are spread over independently locked stripes to keep writers from contending on a single lock
+    struct Stripe {
+        std::mutex mutex;
+        ankerl::unordered_dense::map<std::string, std::uint32_t, StringHash, std::equal_to<>> ids;
+    };
+
+    std::filesystem::path directory;
+
+    std::array<Stripe, 64> stripes;
+    std::atomic<std::uint32_t> nextId;
+
+public:
+    explicit TermDictionaryWriter(const std::filesystem::path& directory)
+        : directory(directory), nextId(0) {}
+
+    // Keeps the ids of the terms in an existing dictionary, new terms get ids after them
+    TermDictionaryWriter(const std::filesystem::path& directory, const TermDictionary& existing)
+        : directory(directory), nextId(existing.size()) {
+        for (std::uint32_t id = 0; id < existing.size(); ++id) {
+            auto term = existing.getTerm(id);
+            stripes[StringHash{}(term) % stripes.size()].ids.emplace(std::string(term), id);
+        }
+    }
+
+    ~TermDictionaryWriter() {
+        write();
+    }
+
+    std::uint32_t getId(std::string_view term) {
+        auto& stripe = stripes[StringHash{}(term) % stripes.size()];
+        std::lock_guard lock(stripe.mutex);
+
+        auto it = stripe.ids.find(term);
+        if (it != stripe.ids.end()) {
+            return it->second;
+        }
+
+        auto id = nextId++;
+        stripe.ids.emplace(std::string(term), id);
+        return id;
+    }
+
+private:
+    void write() {
+        std::vector<std::string_view> terms(nextId);
+        for (const auto& stripe : stripes) {
+            for (const auto& [term, id] : stripe.ids) {
+                terms[id] = term;
+            }
+        }
+
+        FileWriter dataWriter(directory / "data.bin");
+        KeyIndexWriter<std::uint16_t> indexWriter(directory / "index.bin");
+
+        std::uint64_t offset = terms.size() * 8;
+        for (const auto& term : terms) {
+            dataWriter.writeScalar<std::uint64_t>(offset);
+            offset += 2 + term.size();
+        }
+
+        for (std::uint32_t id = 0; id < terms.size(); ++id) {
+            dataWriter.writeString<std::uint16_t>(terms[id]);
+            indexWriter.addKey(terms[id], id);
+        }
+
+        indexWriter.write();
+    }
+};
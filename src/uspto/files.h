@@ -1,161 +1,561 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <ios>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-#include <ankerl/unordered_dense.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <fmt/format.h>
 #include <spdlog/spdlog.h>
 
-class FileReader {
-    std::ifstream in;
+class MappedFile {
+    const char* data;
+    std::uint64_t size;
+    bool resident;
 
 public:
-    explicit FileReader(const std::filesystem::path& file) {
+    // Resident files are read into anonymous memory up front, instead of being paged in from disk on demand
+    explicit MappedFile(const std::filesystem::path& file, bool resident = false)
+        : data(nullptr), size(0), resident(resident) {
         if (!std::filesystem::exists(file)) {
             spdlog::error("{} does not exist", file.generic_string());
             std::exit(1);
         }
 
-        in = std::ifstream(file);
+        size = std::filesystem::file_size(file);
+
+        // mmap() does not support empty mappings, reads from empty files never dereference data anyway
+        if (size == 0) {
+            return;
+        }
+
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            spdlog::error("Opening {} failed: {}", file.generic_string(), std::strerror(errno));
+            std::exit(1);
+        }
+
+        void* address = resident
+                            ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                            : ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (address == MAP_FAILED) {
+            spdlog::error("Mapping {} failed: {}", file.generic_string(), std::strerror(errno));
+            std::exit(1);
+        }
+
+        if (resident) {
+            auto* buffer = static_cast<char*>(address);
+
+            std::uint64_t bytesRead = 0;
+            while (bytesRead < size) {
+                auto result = ::pread(fd, buffer + bytesRead, size - bytesRead, static_cast<off_t>(bytesRead));
+                if (result <= 0) {
+                    spdlog::error("Reading {} failed: {}", file.generic_string(), std::strerror(errno));
+                    std::exit(1);
+                }
+
+                bytesRead += result;
+            }
+        }
+
+        ::close(fd);
+
+        data = static_cast<const char*>(address);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            ::munmap(const_cast<char*>(data), size);
+        }
     }
 
-    std::uint64_t getPosition() {
-        return in.tellg();
+    const char* getData() const {
+        return data;
+    }
+
+    std::uint64_t getSize() const {
+        return size;
+    }
+
+    // Asks the kernel to start reading the given range into the page cache without waiting for it
+    void prefetch(std::uint64_t offset, std::uint64_t length) const {
+        if (data == nullptr || resident || offset >= size) {
+            return;
+        }
+
+        static const std::uint64_t pageSize = ::sysconf(_SC_PAGESIZE);
+
+        auto start = offset / pageSize * pageSize;
+        auto end = std::min(offset + length, size);
+
+        ::madvise(const_cast<char*>(data) + start, end - start, MADV_WILLNEED);
+    }
+};
+
+// Reads from a buffer owned by someone else, cheap enough to create one per read
+class MemoryReader {
+    const char* data;
+    std::uint64_t size;
+    std::uint64_t position;
+
+public:
+    MemoryReader(const char* data, std::uint64_t size, std::uint64_t position = 0)
+        : data(data), size(size), position(position) {}
+
+    std::uint64_t getPosition() const {
+        return position;
     }
 
     void seek(std::uint64_t offset) {
-        in.seekg(offset, std::ios::beg);
+        position = offset;
+    }
+
+    // Skips the padding written by FileWriter::align()
+    // Mapped files are page-aligned, so positions aligned in the file are aligned in memory as well
+    void align(std::uint64_t alignment) {
+        position = (position + alignment - 1) / alignment * alignment;
     }
 
-    bool isEOF() {
-        return in.peek() == std::ifstream::traits_type::eof();
+    bool isEOF() const {
+        return position >= size;
     }
 
-    std::vector<char> readRaw(std::uint64_t size) {
-        std::vector<char> buffer(size);
-        in.read(buffer.data(), size);
-        return buffer;
+    std::string_view readRaw(std::uint64_t length) {
+        std::string_view view(data + position, length);
+        position += length;
+        return view;
     }
 
     template<typename T>
     T readScalar() {
         T value;
-        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+        std::memcpy(&value, data + position, sizeof(T));
+        position += sizeof(T);
+        return value;
+    }
+
+    // Variable-length integers store 7 bits per byte, the high bit is set on all but the last byte
+    std::uint64_t readVarInt() {
+        auto byte = static_cast<std::uint8_t>(data[position++]);
+        if (byte < 0x80) {
+            return byte;
+        }
+
+        std::uint64_t value = byte & 0x7F;
+        int shift = 7;
+
+        do {
+            byte = static_cast<std::uint8_t>(data[position++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte >= 0x80);
+
         return value;
     }
 
     template<typename SizeType>
-    std::string readString() {
+    std::string_view readStringView() {
         auto length = readScalar<SizeType>();
+        return readRaw(length);
+    }
 
-        std::string str(length, '\0');
-        in.read(str.data(), length);
-
-        return str;
+    template<typename SizeType>
+    std::string readString() {
+        return std::string(readStringView<SizeType>());
     }
 };
 
+class FileReader : public MemoryReader {
+    std::shared_ptr<MappedFile> file;
+
+public:
+    explicit FileReader(const std::filesystem::path& file)
+        : FileReader(std::make_shared<MappedFile>(file)) {}
+
+    explicit FileReader(std::shared_ptr<MappedFile> file)
+        : MemoryReader(file->getData(), file->getSize()), file(std::move(file)) {}
+};
+
+// Output is collected in a large in-memory buffer, full buffers are written to disk on a background thread
+// while the next buffer is being filled
 class FileWriter {
+    std::filesystem::path path;
     std::ofstream out;
 
+    std::size_t bufferSize;
+    std::vector<char> buffer;
+    std::vector<char> flushBuffer;
+
+    std::future<bool> pendingFlush;
+    std::uint64_t flushedBytes;
+
 public:
-    explicit FileWriter(const std::filesystem::path& path) {
+    static constexpr std::size_t DEFAULT_BUFFER_SIZE = 16 * 1024 * 1024;
+
+    explicit FileWriter(const std::filesystem::path& path, std::size_t bufferSize = DEFAULT_BUFFER_SIZE)
+        : path(path), bufferSize(bufferSize), flushedBytes(0) {
         if (!std::filesystem::exists(path)) {
             std::filesystem::create_directories(path.parent_path());
         }
 
-        out = std::ofstream(path);
+        out = std::ofstream(path, std::ios::binary);
+
+        buffer.reserve(bufferSize);
+        flushBuffer.reserve(bufferSize);
     }
 
-    std::uint64_t getPosition() {
-        return out.tellp();
+    // The background flush writes from this object's buffers, so it must stay in place
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    ~FileWriter() {
+        flush();
+        waitForFlush();
     }
 
-    void writeRaw(const char* buffer, std::uint64_t size) {
-        out.write(buffer, size);
+    std::uint64_t getPosition() const {
+        return flushedBytes + buffer.size();
+    }
+
+    void writeRaw(const char* data, std::uint64_t size) {
+        buffer.insert(buffer.end(), data, data + size);
+
+        if (buffer.size() >= bufferSize) {
+            flush();
+        }
     }
 
     template<typename T>
     void writeScalar(T value) {
-        out.write(reinterpret_cast<char*>(&value), sizeof(T));
+        writeRaw(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    // Pads the file with zeros up to the next multiple of the given alignment
+    void align(std::uint64_t alignment) {
+        auto padding = (alignment - getPosition() % alignment) % alignment;
+        buffer.insert(buffer.end(), padding, 0);
+    }
+
+    void writeVarInt(std::uint64_t value) {
+        std::array<char, 10> bytes;
+        std::size_t length = 0;
+
+        while (value >= 0x80) {
+            bytes[length++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+
+        bytes[length++] = static_cast<char>(value);
+        writeRaw(bytes.data(), length);
     }
 
     template<typename SizeType>
-    void writeString(const std::string& value) {
+    void writeString(std::string_view value) {
         writeScalar<SizeType>(value.length());
-        out << value;
+        writeRaw(value.data(), value.length());
+    }
+
+private:
+    void flush() {
+        if (buffer.empty()) {
+            return;
+        }
+
+        waitForFlush();
+
+        std::swap(buffer, flushBuffer);
+        buffer.clear();
+        flushedBytes += flushBuffer.size();
+
+        pendingFlush = std::async(std::launch::async, [this] {
+            out.write(flushBuffer.data(), static_cast<std::streamsize>(flushBuffer.size()));
+            return out.good();
+        });
+    }
+
+    void waitForFlush() {
+        if (pendingFlush.valid() && !pendingFlush.get()) {
+            spdlog::error("Writing to {} failed", path.generic_string());
+            std::exit(1);
+        }
     }
 };
 
+// index.bin starts with the number of keys (uint64), followed by a (key offset, data offset) pair of uint64s per key
+// sorted by key, followed by all length-prefixed keys in insertion order
+// Lookups binary search the mapped file directly, so there is nothing to load up front
 template<typename KeySizeType>
-class DataReader : public FileReader {
-    std::filesystem::path directory;
-    std::shared_ptr<ankerl::unordered_dense::map<std::string, std::uint64_t>> index;
+class KeyIndex {
+    std::shared_ptr<MappedFile> file;
+    std::uint64_t keyCount;
 
 public:
-    explicit DataReader(const std::filesystem::path& directory)
-        : FileReader(directory / "data.bin"),
-          directory(directory),
-          index(std::make_shared<ankerl::unordered_dense::map<std::string, std::uint64_t>>()) {
-        FileReader indexReader(directory / "index.bin");
+    explicit KeyIndex(const std::filesystem::path& file)
+        : file(std::make_shared<MappedFile>(file)),
+          keyCount(readUInt64(0)) {}
 
-        std::uint64_t offset = 0;
-        while (!indexReader.isEOF()) {
-            auto key = indexReader.readString<KeySizeType>();
-            offset += indexReader.readScalar<std::uint32_t>();
+    std::uint64_t size() const {
+        return keyCount;
+    }
 
-            index->emplace(key, offset);
+    std::string_view getKey(std::uint64_t i) const {
+        MemoryReader reader(file->getData(), file->getSize(), getKeysOffset() + readUInt64(getEntryOffset(i)));
+        return reader.readStringView<KeySizeType>();
+    }
+
+    std::uint64_t getOffset(std::uint64_t i) const {
+        return readUInt64(getEntryOffset(i) + 8);
+    }
+
+    // Returns the position of the first key that is not less than the given key
+    std::uint64_t lowerBound(std::string_view key) const {
+        std::uint64_t low = 0;
+        std::uint64_t high = keyCount;
+
+        while (low < high) {
+            auto mid = low + (high - low) / 2;
+
+            if (getKey(mid) < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
         }
+
+        return low;
     }
 
-    DataReader(const DataReader& other)
-        : FileReader(other.directory / "data.bin"), directory(other.directory), index(other.index) {}
+    bool contains(std::string_view key) const {
+        auto i = lowerBound(key);
+        return i < keyCount && getKey(i) == key;
+    }
+
+    std::uint64_t at(std::string_view key) const {
+        auto i = lowerBound(key);
+        if (i == keyCount || getKey(i) != key) {
+            throw std::out_of_range(fmt::format("Key '{}' does not exist", key));
+        }
 
-    void seekToKey(const std::string& key) {
-        seek(index->at(key));
+        return getOffset(i);
     }
 
-    std::shared_ptr<ankerl::unordered_dense::map<std::string, std::uint64_t>> getIndex() const {
+private:
+    std::uint64_t readUInt64(std::uint64_t offset) const {
+        return MemoryReader(file->getData(), file->getSize(), offset).readScalar<std::uint64_t>();
+    }
+
+    std::uint64_t getEntryOffset(std::uint64_t i) const {
+        return 8 + i * 16;
+    }
+
+    std::uint64_t getKeysOffset() const {
+        return getEntryOffset(keyCount);
+    }
+};
+
+template<typename KeySizeType>
+class KeyIndexWriter {
+    std::filesystem::path file;
+
+    std::string keys;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> entries;
+
+public:
+    explicit KeyIndexWriter(const std::filesystem::path& file)
+        : file(file) {}
+
+    void addKey(std::string_view key, std::uint64_t offset) {
+        entries.emplace_back(keys.size(), offset);
+
+        auto length = static_cast<KeySizeType>(key.length());
+        keys.append(reinterpret_cast<const char*>(&length), sizeof(KeySizeType));
+        keys.append(key);
+    }
+
+    void write() {
+        // Stable so that the first occurrence of a duplicate key wins, like emplace() into a map
+        std::stable_sort(
+            entries.begin(),
+            entries.end(),
+            [&](const std::pair<std::uint64_t, std::uint64_t>& a, const std::pair<std::uint64_t, std::uint64_t>& b) {
+                return getKey(a.first) < getKey(b.first);
+            });
+
+        FileWriter writer(file);
+
+        writer.writeScalar<std::uint64_t>(entries.size());
+        for (const auto& [keyOffset, dataOffset] : entries) {
+            writer.writeScalar<std::uint64_t>(keyOffset);
+            writer.writeScalar<std::uint64_t>(dataOffset);
+        }
+
+        writer.writeRaw(keys.data(), keys.size());
+    }
+
+private:
+    std::string_view getKey(std::uint64_t keyOffset) const {
+        return MemoryReader(keys.data(), keys.size(), keyOffset).readStringView<KeySizeType>();
+    }
+};
+
+// Sharded stores consist of a shard-<i> directory per shard, each containing its own data.bin and index.bin
+// The top-level index.bin maps every key to a location, which encodes the shard in its upper bits
+constexpr int SHARD_LOCATION_BITS = 48;
+
+inline std::filesystem::path getShardDirectory(const std::filesystem::path& directory, std::size_t shard) {
+    return directory / fmt::format("shard-{}", shard);
+}
+
+inline std::uint64_t getShardLocation(std::size_t shard, std::uint64_t offset) {
+    return (static_cast<std::uint64_t>(shard) << SHARD_LOCATION_BITS) | offset;
+}
+
+inline std::size_t getLocationShard(std::uint64_t location) {
+    return location >> SHARD_LOCATION_BITS;
+}
+
+inline std::uint64_t getLocationOffset(std::uint64_t location) {
+    return location & ((static_cast<std::uint64_t>(1) << SHARD_LOCATION_BITS) - 1);
+}
+
+// Returns the directory of every shard of a store, or the store itself if it is not sharded
+inline std::vector<std::filesystem::path> getShardDirectories(const std::filesystem::path& directory) {
+    std::vector<std::filesystem::path> directories;
+
+    for (std::size_t i = 0; std::filesystem::exists(getShardDirectory(directory, i)); ++i) {
+        directories.emplace_back(getShardDirectory(directory, i));
+    }
+
+    if (directories.empty()) {
+        directories.emplace_back(directory);
+    }
+
+    return directories;
+}
+
+// All reads go through short-lived MemoryReaders, so a single instance can be shared between threads
+template<typename KeySizeType>
+class DataReader {
+    std::vector<std::shared_ptr<MappedFile>> shards;
+    KeyIndex<KeySizeType> index;
+
+public:
+    // Resident readers keep the data of all shards in memory, the index is always paged in on demand
+    explicit DataReader(const std::filesystem::path& directory, bool resident = false)
+        : shards(openShards(directory, resident)),
+          index(directory / "index.bin") {}
+
+    MemoryReader getReader(std::uint64_t location) const {
+        const auto& shard = getShard(location);
+        return MemoryReader(shard.getData(), shard.getSize(), getShardOffset(location));
+    }
+
+    MemoryReader getKeyReader(const std::string& key) const {
+        return getReader(index.at(key));
+    }
+
+    const KeyIndex<KeySizeType>& getIndex() const {
         return index;
     }
 
+    void prefetch(std::uint64_t location, std::uint64_t length) const {
+        getShard(location).prefetch(getShardOffset(location), length);
+    }
+
+    // Sorts keys by their location, making sequential reads of the keys as sequential as possible on disk
     void sortToIndex(std::vector<std::string>& keys) const {
+        std::vector<std::pair<std::uint64_t, std::string>> locations;
+        locations.reserve(keys.size());
+
+        for (auto& key : keys) {
+            auto location = index.at(key);
+            locations.emplace_back(location, std::move(key));
+        }
+
         std::sort(
-            keys.begin(),
-            keys.end(),
-            [&](const std::string& a, const std::string& b) {
-                return index->at(a) < index->at(b);
+            locations.begin(),
+            locations.end(),
+            [](const std::pair<std::uint64_t, std::string>& a, const std::pair<std::uint64_t, std::string>& b) {
+                return a.first < b.first;
             });
+
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            keys[i] = std::move(locations[i].second);
+        }
+    }
+
+private:
+    const MappedFile& getShard(std::uint64_t location) const {
+        return *shards[getLocationShard(location)];
+    }
+
+    std::uint64_t getShardOffset(std::uint64_t location) const {
+        return getLocationOffset(location);
+    }
+
+    static std::vector<std::shared_ptr<MappedFile>> openShards(const std::filesystem::path& directory, bool resident) {
+        std::vector<std::shared_ptr<MappedFile>> shards;
+
+        for (const auto& shardDirectory : getShardDirectories(directory)) {
+            shards.emplace_back(std::make_shared<MappedFile>(shardDirectory / "data.bin", resident));
+        }
+
+        return shards;
     }
 };
 
 template<typename KeySizeType>
 class DataWriter : public FileWriter {
-    FileWriter indexWriter;
-
-    std::uint64_t lastPosition;
+    KeyIndexWriter<KeySizeType> indexWriter;
 
 public:
-    explicit DataWriter(const std::filesystem::path& directory)
-        : FileWriter(directory / "data.bin"),
-          indexWriter(directory / "index.bin"),
-          lastPosition(0) {}
-
-    void addKey(const std::string& key) {
-        auto currentPosition = getPosition();
-        auto deltaPosition = currentPosition - lastPosition;
-        lastPosition = currentPosition;
-
-        indexWriter.writeString<KeySizeType>(key);
-        indexWriter.writeScalar<std::uint32_t>(deltaPosition);
+    explicit DataWriter(const std::filesystem::path& directory, std::size_t bufferSize = DEFAULT_BUFFER_SIZE)
+        : FileWriter(directory / "data.bin", bufferSize),
+          indexWriter(directory / "index.bin") {}
+
+    ~DataWriter() {
+        indexWriter.write();
+    }
+
+    void addKey(std::string_view key) {
+        indexWriter.addKey(key, getPosition());
+    }
+
+    // Writes the top-level index.bin of a sharded store after all shard writers have been destroyed
+    // Keys which occur in multiple shards point to the last of them, so that appended shards override older data
+    static void mergeShards(const std::filesystem::path& directory, std::size_t shardCount) {
+        KeyIndexWriter<KeySizeType> mergedIndexWriter(directory / "index.bin");
+
+        for (std::size_t i = shardCount; i-- > 0;) {
+            KeyIndex<KeySizeType> shardIndex(getShardDirectory(directory, i) / "index.bin");
+
+            for (std::uint64_t j = 0; j < shardIndex.size(); ++j) {
+                mergedIndexWriter.addKey(shardIndex.getKey(j), getShardLocation(i, shardIndex.getOffset(j)));
+            }
+        }
+
+        mergedIndexWriter.write();
     }
 };
 
@@ -30,9 +30,12 @@ public:
 
     virtual std::string getName() const = 0;
 
+    // The categories of which terms are read, used to prefetch them before running the generator
+    virtual TermCategory::TermCategory getCategories() const = 0;
+
     virtual std::string generateQuery(
         const std::vector<std::string>& targets,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher) const = 0;
 
@@ -117,9 +120,13 @@ public:
         return fmt::format("SingleTermQueryGenerator(category={})", TermCategory::toString(category));
     }
 
+    TermCategory::TermCategory getCategories() const override {
+        return category;
+    }
+
     std::string generateQuery(
         const std::vector<std::string>& targets,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher) const override {
         ankerl::unordered_dense::map<std::string, int> counts;
@@ -181,11 +188,7 @@ class FPGrowthQueryGenerator : public QueryGenerator {
               resultsSize(0) {}
 
         void report(const std::vector<std::string>& terms, int support) {
-            double selectivity = searchIndex.getTermSelectivity(terms[0]);
-            for (std::size_t i = 1; i < terms.size(); ++i) {
-                selectivity *= searchIndex.getTermSelectivity(terms[i]);
-            }
-
+            double selectivity = searchIndex.estimateSelectivity(terms, support);
             double score = static_cast<double>(support) * selectivity;
 
             FPResult result(terms, support, score);
@@ -222,9 +225,13 @@ public:
             maxXorGroups);
     }
 
+    TermCategory::TermCategory getCategories() const override {
+        return categories;
+    }
+
     std::string generateQuery(
         const std::vector<std::string>& targets,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher) const override {
         std::vector<std::vector<std::string>> termGroups;
@@ -485,9 +492,13 @@ public:
             maxXorGroups);
     }
 
+    TermCategory::TermCategory getCategories() const override {
+        return categories;
+    }
+
     std::string generateQuery(
         const std::vector<std::string>& targets,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher) const override {
         std::vector<std::set<std::string>> termsByTarget;
@@ -647,7 +658,7 @@ private:
 
             const auto& newTerm = group.availableTerms.back();
             group.selectedTerms.emplace_back(newTerm.first);
-            group.selectivity *= newTerm.second;
+            group.selectivity = searchIndex.estimateSelectivity(group.selectedTerms);
 
             group.availableTerms.pop_back();
             tokensRemaining -= bestGroupRequiredTokens;
@@ -729,9 +740,13 @@ public:
             maxXorGroups);
     }
 
+    TermCategory::TermCategory getCategories() const override {
+        return categories;
+    }
+
     std::string generateQuery(
         const std::vector<std::string>& targets,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher) const override {
         ankerl::unordered_dense::map<std::string, ankerl::unordered_dense::set<std::string>> termsByTarget;
@@ -810,9 +825,9 @@ public:
                 const auto& currentGroup = groups.back();
                 std::vector<std::string> currentGroupVec(currentGroup.begin(), currentGroup.end());
 
-                auto bitset = searchIndex.getTermBitset(currentGroupVec[0]);
+                auto bitset = *searchIndex.getTermBitset(currentGroupVec[0]);
                 for (std::size_t i = 1; i < currentGroup.size(); ++i) {
-                    bitset &= searchIndex.getTermBitset(currentGroupVec[i]);
+                    bitset &= *searchIndex.getTermBitset(currentGroupVec[i]);
                 }
 
                 std::size_t minCardinality = std::numeric_limits<std::size_t>::max();
@@ -822,7 +837,7 @@ public:
                         continue;
                     }
 
-                    std::size_t cardinality = bitset.and_cardinality(searchIndex.getTermBitset(term));
+                    std::size_t cardinality = bitset.and_cardinality(*searchIndex.getTermBitset(term));
                     if (cardinality < minCardinality) {
                         bestTerm = term;
                         minCardinality = cardinality;
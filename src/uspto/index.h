@@ -1,11 +1,17 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <queue>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -15,29 +21,66 @@
 #include <roaring/roaring.hh>
 #include <spdlog/spdlog.h>
 
+#include <uspto/cache.h>
+#include <uspto/config.h>
 #include <uspto/files.h>
 #include <uspto/patents.h>
 #include <uspto/progress.h>
 #include <uspto/queries.h>
+#include <uspto/queue.h>
+
+// Bitsets are stored in the frozen format, which can be used in place as long as it's aligned to 32 bytes
+constexpr std::uint64_t FROZEN_BITSET_ALIGNMENT = 32;
+
+// Summary of a term's counts, all terms' statistics are stored together so that they can be loaded at once
+// The sketch of a term holds the smallest hashes of its patent ids, which is all of them for rare terms
+struct TermStatistics {
+    std::uint32_t patentCount;
+    std::uint64_t totalCount;
+    std::uint16_t maxCount;
+    double idf;
+
+    std::uint64_t sketchOffset;
+    std::uint8_t sketchSize;
+};
+
+constexpr std::size_t TERM_SKETCH_SIZE = 64;
+
+// Sketch estimates based on fewer shared hashes fall back to assuming the terms occur independently
+constexpr std::size_t MIN_SHARED_HASHES = 3;
+
+// Murmur3's finalizer, a bijection which spreads patent ids uniformly over all 32-bit values
+inline std::uint32_t getSketchHash(std::uint32_t patentId) {
+    patentId ^= patentId >> 16;
+    patentId *= 0x85EBCA6B;
+    patentId ^= patentId >> 13;
+    patentId *= 0xC2B2AE35;
+    patentId ^= patentId >> 16;
+
+    return patentId;
+}
+
+inline double getIdf(std::uint32_t patentCount, std::uint32_t termPatentCount) {
+    return std::log(static_cast<double>(patentCount) / (static_cast<double>(termPatentCount) + 1)) + 1;
+}
 
 class SearchIndexReader : public DataReader<std::uint16_t> {
 public:
     using DataReader::DataReader;
 
-    std::uint32_t readPatentCount() {
-        seekToKey("ids");
-        return readScalar<std::uint32_t>();
+    std::uint32_t readPatentCount() const {
+        return getKeyReader("ids").readScalar<std::uint32_t>();
     }
 
-    std::vector<std::string> readPatentIdsReversed() {
-        seekToKey("ids");
+    std::vector<std::string> readPatentIdsReversed() const {
+        auto reader = getKeyReader("ids");
 
-        auto size = readScalar<std::uint32_t>();
+        auto size = reader.readScalar<std::uint32_t>();
         std::vector<std::string> publicationNumbers(size);
 
         for (std::uint32_t i = 0; i < size; ++i) {
-            auto publicationNumber = readString<std::uint8_t>();
-            auto id = readScalar<std::uint32_t>();
+            auto publicationNumber = reader.readString<std::uint8_t>();
+            auto id = reader.readScalar<std::uint32_t>();
 
             publicationNumbers[id] = publicationNumber;
         }
@@ -45,44 +88,105 @@ public:
         return publicationNumbers;
     }
 
-    roaring::Roaring readTermBitset(const std::string& term) {
-        seekToKey(term);
+    // The bitset is a frozen view into the mapped data, which stays valid as long as this reader
+    roaring::Roaring readTermBitset(const std::string& term) const {
+        auto reader = getKeyReader(term);
 
-        auto size = readScalar<std::uint32_t>();
-        auto buffer = readRaw(size);
+        auto size = reader.readScalar<std::uint32_t>();
+        reader.align(FROZEN_BITSET_ALIGNMENT);
+        auto buffer = reader.readRaw(size);
 
-        return roaring::Roaring::read(buffer.data(), false);
+        return roaring::Roaring::frozenView(buffer.data(), size);
     }
 
-    ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> readTermCounts(const std::string& term) {
-        seekToKey(" " + term);
+    // Returns the counts of the term in the order of the patent ids in its bitset
+    std::vector<std::uint16_t> readTermCounts(const std::string& term) const {
+        auto reader = getKeyReader(" " + term);
 
-        ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> counts;
+        auto size = reader.readScalar<std::uint32_t>();
+        std::vector<std::uint16_t> counts(size);
 
-        auto size = readScalar<std::uint32_t>();
-        counts.reserve(size);
+        auto buffer = reader.readRaw(size * sizeof(std::uint16_t));
+        std::memcpy(counts.data(), buffer.data(), size * sizeof(std::uint16_t));
+
+        return counts;
+    }
+
+    // The terms are views into the mapped data, which stay valid as long as this reader
+    // The sketches of all terms are appended to the given vector
+    std::vector<std::pair<std::string_view, TermStatistics>> readTermStatistics(
+        std::vector<std::uint32_t>& sketches) const {
+        auto reader = getKeyReader("statistics");
+
+        auto size = reader.readScalar<std::uint32_t>();
+        std::vector<std::pair<std::string_view, TermStatistics>> statistics;
+        statistics.reserve(size);
 
         for (std::uint32_t i = 0; i < size; ++i) {
-            auto patentId = readScalar<std::uint32_t>();
-            auto count = readScalar<std::uint16_t>();
+            auto term = reader.readStringView<std::uint16_t>();
+
+            TermStatistics termStatistics{};
+            termStatistics.patentCount = reader.readScalar<std::uint32_t>();
+            termStatistics.totalCount = reader.readScalar<std::uint64_t>();
+            termStatistics.maxCount = reader.readScalar<std::uint16_t>();
+            termStatistics.idf = reader.readScalar<double>();
+
+            termStatistics.sketchOffset = sketches.size();
+            termStatistics.sketchSize = reader.readScalar<std::uint8_t>();
+            for (std::uint8_t j = 0; j < termStatistics.sketchSize; ++j) {
+                sketches.emplace_back(reader.readScalar<std::uint32_t>());
+            }
 
-            counts.emplace(patentId, count);
+            statistics.emplace_back(term, termStatistics);
         }
 
-        return counts;
+        return statistics;
+    }
+
+    std::uint32_t readTermCardinality(const std::string& term) const {
+        return getKeyReader(" " + term).readScalar<std::uint32_t>();
     }
 
-    std::uint32_t readTermCardinality(const std::string& term) {
-        seekToKey(" " + term);
-        return readScalar<std::uint32_t>();
+    bool containsTerm(const std::string& term) const {
+        return getIndex().contains(term);
+    }
+
+    // Returns all terms starting with the given prefix, which are adjacent in the sorted index
+    // Materialized wildcard terms like "cpc:H04L*" are skipped, they only repeat the patents of the terms they cover
+    std::vector<std::string> readTermsWithPrefix(std::string_view prefix) const {
+        const auto& index = getIndex();
+
+        std::vector<std::string> terms;
+        for (auto i = index.lowerBound(prefix); i < index.size(); ++i) {
+            auto key = index.getKey(i);
+            if (key.substr(0, prefix.length()) != prefix) {
+                break;
+            }
+
+            if (key.back() != '*') {
+                terms.emplace_back(key);
+            }
+        }
+
+        return terms;
     }
 };
 
 class SearchIndexWriter : public DataWriter<std::uint16_t> {
+    std::uint32_t patentCount = 0;
+    std::vector<std::pair<std::string, TermStatistics>> statistics;
+    std::vector<std::uint32_t> sketches;
+
 public:
     using DataWriter::DataWriter;
 
+    ~SearchIndexWriter() {
+        writeStatistics();
+    }
+
     void writeIds(const ankerl::unordered_dense::map<std::string, std::uint32_t>& ids) {
+        patentCount = ids.size();
+
         addKey("ids");
 
         writeScalar<std::uint32_t>(ids.size());
@@ -95,245 +199,609 @@ public:
     void writeCounts(
         const std::string& term,
         const ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>& counts) {
-        writeCountsAsBitset(term, counts);
-        writeCountsAsMap(term, counts);
+        std::vector<std::pair<std::uint32_t, std::uint16_t>> sortedCounts(counts.begin(), counts.end());
+        std::sort(sortedCounts.begin(), sortedCounts.end());
+
+        writeSortedCounts(term, sortedCounts);
+    }
+
+    // Like writeCounts(), for counts which are already sorted by patent id
+    void writeSortedCounts(
+        const std::string& term,
+        const std::vector<std::pair<std::uint32_t, std::uint16_t>>& sortedCounts) {
+        writeCountsAsBitset(term, sortedCounts);
+        writeCountsAsColumn(term, sortedCounts);
+
+        TermStatistics termStatistics{};
+        termStatistics.patentCount = sortedCounts.size();
+        for (const auto& [_, count] : sortedCounts) {
+            termStatistics.totalCount += count;
+            termStatistics.maxCount = std::max(termStatistics.maxCount, count);
+        }
+
+        std::vector<std::uint32_t> hashes;
+        hashes.reserve(sortedCounts.size());
+        for (const auto& [patentId, _] : sortedCounts) {
+            hashes.emplace_back(getSketchHash(patentId));
+        }
+
+        auto sketchSize = std::min(hashes.size(), TERM_SKETCH_SIZE);
+        std::partial_sort(hashes.begin(), hashes.begin() + sketchSize, hashes.end());
+
+        termStatistics.sketchOffset = sketches.size();
+        termStatistics.sketchSize = sketchSize;
+        sketches.insert(sketches.end(), hashes.begin(), hashes.begin() + sketchSize);
+
+        statistics.emplace_back(term, termStatistics);
     }
 
 private:
+    void writeStatistics() {
+        addKey("statistics");
+
+        writeScalar<std::uint32_t>(statistics.size());
+        for (const auto& [term, termStatistics] : statistics) {
+            writeString<std::uint16_t>(term);
+            writeScalar<std::uint32_t>(termStatistics.patentCount);
+            writeScalar<std::uint64_t>(termStatistics.totalCount);
+            writeScalar<std::uint16_t>(termStatistics.maxCount);
+            writeScalar<double>(getIdf(patentCount, termStatistics.patentCount));
+
+            writeScalar<std::uint8_t>(termStatistics.sketchSize);
+            for (std::uint8_t i = 0; i < termStatistics.sketchSize; ++i) {
+                writeScalar<std::uint32_t>(sketches[termStatistics.sketchOffset + i]);
+            }
+        }
+    }
+
     void writeCountsAsBitset(
         const std::string& term,
-        const ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>& counts) {
+        const std::vector<std::pair<std::uint32_t, std::uint16_t>>& sortedCounts) {
         roaring::Roaring bitset;
         roaring::BulkContext bulkContext;
 
-        for (const auto& [patentId, _] : counts) {
+        for (const auto& [patentId, _] : sortedCounts) {
             bitset.addBulk(bulkContext, patentId);
         }
 
         bitset.runOptimize();
         bitset.shrinkToFit();
 
-        addKey(term);
-
-        auto size = bitset.getSizeInBytes(false);
+        auto size = bitset.getFrozenSizeInBytes();
         std::vector<char> buffer(size);
 
-        bitset.write(buffer.data(), false);
+        bitset.writeFrozen(buffer.data());
+
+        addKey(term);
 
         writeScalar<std::uint32_t>(size);
+        align(FROZEN_BITSET_ALIGNMENT);
         writeRaw(buffer.data(), size);
     }
 
-    void writeCountsAsMap(
+    // The counts are packed in the same order as the patent ids in the bitset, so the count of a patent is found at
+    // its rank in the bitset
+    void writeCountsAsColumn(
         const std::string& term,
-        const ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>& counts) {
+        const std::vector<std::pair<std::uint32_t, std::uint16_t>>& sortedCounts) {
         addKey(" " + term);
 
-        writeScalar<std::uint32_t>(counts.size());
-        for (const auto& [patentId, count] : counts) {
-            writeScalar<std::uint32_t>(patentId);
+        writeScalar<std::uint32_t>(sortedCounts.size());
+        for (const auto& [_, count] : sortedCounts) {
             writeScalar<std::uint16_t>(count);
         }
     }
 };
 
+// Shared by all threads, the cached bitsets, counts and cardinalities together stay within the given budget
 class SearchIndex {
-    SearchIndexReader reader;
+    const SearchIndexReader& reader;
 
     std::uint32_t patentCount;
 
-    ankerl::unordered_dense::map<std::string, roaring::Roaring> bitsets;
-    ankerl::unordered_dense::map<std::string, ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>> counts;
-    ankerl::unordered_dense::map<std::string, std::uint32_t> cardinalities;
+    // Statistics of the terms in the index are loaded at once, only those of prefix terms are computed on demand
+    std::vector<TermStatistics> statistics;
+    ankerl::unordered_dense::map<std::string_view, std::uint32_t> statisticsIndices;
+    std::vector<std::uint32_t> sketches;
 
-    std::vector<double> tfIdfScores;
+    ConcurrentCache<roaring::Roaring> bitsets;
+    ConcurrentCache<std::vector<std::uint16_t>> counts;
+    ConcurrentCache<std::uint32_t> cardinalities;
 
 public:
-    explicit SearchIndex(const SearchIndexReader& reader)
-        : reader(reader), patentCount(this->reader.readPatentCount()), tfIdfScores(patentCount) {}
-
-    void clearCache() {
-        bitsets.clear();
-        counts.clear();
-        cardinalities.clear();
+    explicit SearchIndex(const SearchIndexReader& reader, std::uint64_t cacheLimit = getSearchIndexCacheLimit())
+        : reader(reader),
+          patentCount(reader.readPatentCount()),
+          bitsets(cacheLimit / 2),
+          counts(cacheLimit / 2 - cacheLimit / 16),
+          cardinalities(cacheLimit / 16) {
+        auto termStatistics = reader.readTermStatistics(sketches);
+
+        statistics.reserve(termStatistics.size());
+        statisticsIndices.reserve(termStatistics.size());
+
+        for (const auto& [term, statistic] : termStatistics) {
+            statisticsIndices.emplace(term, statistics.size());
+            statistics.emplace_back(statistic);
+        }
     }
 
     std::uint32_t getPatentCount() const {
         return patentCount;
     }
 
-    const roaring::Roaring& getTermBitset(const std::string& term) {
-        auto it = bitsets.find(term);
-        if (it != bitsets.end()) {
-            return it->second;
-        }
+    // Terms ending with a * which are not in the index themselves, like "ti:semicond*", match every term starting with
+    // the part before the *
+    std::shared_ptr<const roaring::Roaring> getTermBitset(const std::string& term) {
+        return bitsets.get(
+            term,
+            [&] {
+                if (!isPrefixTerm(term)) {
+                    return reader.readTermBitset(term);
+                }
+
+                std::vector<roaring::Roaring> prefixBitsets;
+                for (const auto& prefixTerm : getPrefixTerms(term)) {
+                    prefixBitsets.emplace_back(reader.readTermBitset(prefixTerm));
+                }
 
-        bitsets.emplace(term, reader.readTermBitset(term));
-        return bitsets[term];
+                std::vector<const roaring::Roaring*> pointers;
+                pointers.reserve(prefixBitsets.size());
+                for (const auto& bitset : prefixBitsets) {
+                    pointers.emplace_back(&bitset);
+                }
+
+                return roaring::Roaring::fastunion(pointers.size(), pointers.data());
+            },
+            [](const roaring::Roaring& bitset) {
+                return bitset.getSizeInBytes(false);
+            });
     }
 
-    const ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>& getTermCounts(const std::string& term) {
-        auto it = counts.find(term);
-        if (it != counts.end()) {
-            return it->second;
-        }
+    // Returns the counts of the term in the order of the patent ids in its bitset
+    std::shared_ptr<const std::vector<std::uint16_t>> getTermCounts(const std::string& term) {
+        return counts.get(
+            term,
+            [&] {
+                if (!isPrefixTerm(term)) {
+                    return reader.readTermCounts(term);
+                }
+
+                auto bitset = getTermBitset(term);
+                std::vector<std::uint32_t> prefixCounts(bitset->cardinality());
+
+                for (const auto& prefixTerm : getPrefixTerms(term)) {
+                    auto prefixBitset = reader.readTermBitset(prefixTerm);
+                    auto termCounts = reader.readTermCounts(prefixTerm);
+
+                    std::size_t i = 0;
+                    for (auto patentId : prefixBitset) {
+                        prefixCounts[bitset->rank(patentId) - 1] += termCounts[i++];
+                    }
+                }
+
+                // Broad prefixes can match a patent more often than a count can hold
+                std::vector<std::uint16_t> out(prefixCounts.size());
+                for (std::size_t i = 0; i < prefixCounts.size(); ++i) {
+                    out[i] = std::min<std::uint32_t>(prefixCounts[i], std::numeric_limits<std::uint16_t>::max());
+                }
 
-        counts.emplace(term, reader.readTermCounts(term));
-        return counts[term];
+                return out;
+            },
+            [](const std::vector<std::uint16_t>& termCounts) {
+                return termCounts.size() * sizeof(std::uint16_t);
+            });
     }
 
     std::uint32_t getTermCardinality(const std::string& term) {
-        auto it = cardinalities.find(term);
-        if (it != cardinalities.end()) {
-            return it->second;
+        auto it = statisticsIndices.find(term);
+        if (it != statisticsIndices.end()) {
+            return statistics[it->second].patentCount;
         }
 
-        cardinalities.emplace(term, reader.readTermCardinality(term));
-        return cardinalities[term];
+        return *cardinalities.get(
+            term,
+            [&] {
+                if (isPrefixTerm(term)) {
+                    return static_cast<std::uint32_t>(getTermBitset(term)->cardinality());
+                }
+
+                return reader.readTermCardinality(term);
+            },
+            [](std::uint32_t) {
+                return sizeof(std::uint32_t);
+            });
     }
 
     double getTermSelectivity(const std::string& term) {
         return static_cast<double>(getTermCardinality(term)) / static_cast<double>(patentCount);
     }
+
+    // Estimates how many patents contain all given terms from the sketches of the terms, without reading any bitsets
+    // The estimate is exact when none of the terms occur in more than TERM_SKETCH_SIZE patents
+    // Terms without statistics, like prefix terms, fall back to assuming the terms occur independently
+    // The lower bound is a number of patents known to contain all terms, like the support of an itemset
+    double estimateCardinality(const std::vector<std::string>& terms, std::uint32_t lowerBound = 0) {
+        std::vector<const TermStatistics*> termStatistics;
+        termStatistics.reserve(terms.size());
+
+        for (const auto& term : terms) {
+            auto it = statisticsIndices.find(term);
+            if (it == statisticsIndices.end()) {
+                return std::max(estimateIndependentCardinality(terms), static_cast<double>(lowerBound));
+            }
+
+            termStatistics.emplace_back(&statistics[it->second]);
+        }
+
+        if (termStatistics.size() == 1) {
+            return termStatistics[0]->patentCount;
+        }
+
+        bool isExact = true;
+        std::uint32_t minPatentCount = patentCount;
+        std::vector<std::uint32_t> hashes;
+
+        for (const auto* statistic : termStatistics) {
+            isExact = isExact && statistic->sketchSize == statistic->patentCount;
+            minPatentCount = std::min(minPatentCount, statistic->patentCount);
+
+            auto sketch = sketches.begin() + statistic->sketchOffset;
+            hashes.insert(hashes.end(), sketch, sketch + statistic->sketchSize);
+        }
+
+        // The smallest hashes of the union are a sample of the union, which is checked against every sketch
+        // A sketch which isn't exact contains every hash of its term up to the largest hash of the sample
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        if (!isExact) {
+            hashes.resize(TERM_SKETCH_SIZE);
+        }
+
+        std::size_t sharedCount = 0;
+        for (auto hash : hashes) {
+            bool isShared = std::all_of(
+                termStatistics.begin(),
+                termStatistics.end(),
+                [&](const TermStatistics* statistic) {
+                    auto sketch = sketches.begin() + statistic->sketchOffset;
+                    return std::binary_search(sketch, sketch + statistic->sketchSize, hash);
+                });
+
+            if (isShared) {
+                ++sharedCount;
+            }
+        }
+
+        if (isExact) {
+            return std::max<double>(sharedCount, lowerBound);
+        }
+
+        double estimate;
+
+        // Terms which overlap in a small part of their union rarely share any hash of the sample, an estimate from one
+        // or two shared hashes is mostly noise, so the independent estimate is used instead
+        if (sharedCount < MIN_SHARED_HASHES) {
+            estimate = estimateIndependentCardinality(terms);
+        } else {
+            double unionCardinality =
+                (TERM_SKETCH_SIZE - 1) / ((static_cast<double>(hashes.back()) + 1) / 4294967296.0);
+            estimate = static_cast<double>(sharedCount) / TERM_SKETCH_SIZE * unionCardinality;
+        }
+
+        return std::max(std::min(estimate, static_cast<double>(minPatentCount)), static_cast<double>(lowerBound));
+    }
+
+    double estimateSelectivity(const std::vector<std::string>& terms, std::uint32_t lowerBound = 0) {
+        return estimateCardinality(terms, lowerBound) / static_cast<double>(patentCount);
+    }
+
+    double getTermIdf(const std::string& term) {
+        auto it = statisticsIndices.find(term);
+        if (it != statisticsIndices.end()) {
+            return statistics[it->second].idf;
+        }
+
+        return getIdf(patentCount, getTermCardinality(term));
+    }
+
+private:
+    // Number of patents containing all given terms if the terms occurred independently of each other
+    double estimateIndependentCardinality(const std::vector<std::string>& terms) {
+        double selectivity = 1.0;
+        for (const auto& term : terms) {
+            selectivity *= getTermSelectivity(term);
+        }
+
+        return selectivity * static_cast<double>(patentCount);
+    }
+
+    bool isPrefixTerm(const std::string& term) const {
+        return !term.empty() && term.back() == '*' && !reader.containsTerm(term);
+    }
+
+    std::vector<std::string> getPrefixTerms(const std::string& term) const {
+        return reader.readTermsWithPrefix(std::string_view(term).substr(0, term.length() - 1));
+    }
 };
 
-inline void processTermGroup(
-    SearchIndexWriter& writer,
-    const PatentReader& patentReader,
-    BS::thread_pool& threadPool,
-    const std::vector<std::string>& publicationNumbers,
-    const ankerl::unordered_dense::map<std::string, std::uint32_t>& patentIds,
-    TermCategory::TermCategory category,
-    const ankerl::unordered_dense::set<std::string>& terms,
-    const std::string& description) {
-    ankerl::unordered_dense::map<std::string, ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>> termCounts;
-    std::mutex termCountsMutex;
-
-    ProgressBar progressBar(publicationNumbers.size(), description);
-    bool acceptAllTerms = terms.empty();
-
-    threadPool.detach_blocks(
-        static_cast<std::size_t>(0),
-        publicationNumbers.size(),
-        [&](std::size_t start, std::size_t end) {
-            PatentReader localPatentReader(patentReader);
-            ankerl::unordered_dense::map<
-                std::string,
-                ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>> localTermCounts;
-
-            for (std::size_t i = start; i < end; ++i) {
-                const auto& publicationNumber = publicationNumbers[i];
-                auto patentId = patentIds.at(publicationNumber);
-
-                auto patentCounts = localPatentReader.readTermsWithCounts(publicationNumber, category);
-                for (const auto& [term, count] : patentCounts) {
-                    if (acceptAllTerms || terms.contains(term)) {
-                        localTermCounts[term].emplace(patentId, count);
+// Collects the postings of all patents in a single pass over the patent store, SPIMI-style
+// Every block of patents buffers its postings in memory, sorted runs are spilled to disk whenever the buffer reaches
+// its share of the memory limit, after which all runs are k-way merged into the search index term by term
+class PostingsBuilder {
+    struct Posting {
+        std::uint32_t term;
+        std::uint32_t patentId;
+        std::uint16_t count;
+
+        bool operator<(const Posting& other) const {
+            return term < other.term || (term == other.term && patentId < other.patentId);
+        }
+
+        bool operator>(const Posting& other) const {
+            return other < *this;
+        }
+    };
+
+    std::filesystem::path runsDirectory;
+    std::uint64_t postingsPerBlock;
+
+    std::vector<std::filesystem::path> runs;
+    std::uint64_t postingCount;
+    std::mutex runsMutex;
+
+public:
+    // Only as many blocks as there are threads buffer postings at the same time, so each of them gets that share of
+    // the memory limit
+    PostingsBuilder(const std::filesystem::path& runsDirectory, std::uint64_t memoryLimit, std::size_t threadCount)
+        : runsDirectory(runsDirectory),
+          postingsPerBlock(std::max<std::uint64_t>(memoryLimit / threadCount / sizeof(Posting), 1)),
+          postingCount(0) {
+        std::filesystem::remove_all(runsDirectory);
+        std::filesystem::create_directories(runsDirectory);
+    }
+
+    ~PostingsBuilder() {
+        std::filesystem::remove_all(runsDirectory);
+    }
+
+    void collect(
+        const PatentReader& patentReader,
+        BS::thread_pool& threadPool,
+        const std::vector<std::string>& publicationNumbers,
+        const ankerl::unordered_dense::map<std::string, std::uint32_t>& patentIds,
+        TermCategory::TermCategory categories,
+        std::size_t blockCount) {
+        ProgressBar progressBar(
+            publicationNumbers.size(),
+            fmt::format("Collecting {} postings", TermCategory::toString(categories)));
+
+        threadPool.detach_blocks(
+            static_cast<std::size_t>(0),
+            publicationNumbers.size(),
+            [&](std::size_t start, std::size_t end) {
+                // The buffer never grows past its share, growing it by doubling would overshoot the share and hold
+                // the old and the new buffer at once while copying, pages are only backed by memory once they're used
+                std::vector<Posting> postings;
+                postings.reserve(postingsPerBlock);
+
+                for (std::size_t i = start; i < end; ++i) {
+                    const auto& publicationNumber = publicationNumbers[i];
+                    auto patentId = patentIds.at(publicationNumber);
+
+                    auto termCounts = patentReader.readTermIdsWithCounts(publicationNumber, categories);
+                    if (postings.size() + termCounts.size() > postingsPerBlock) {
+                        spill(postings);
+                    }
+
+                    for (const auto& [term, count] : termCounts) {
+                        postings.push_back({term, patentId, count});
                     }
+
+                    progressBar.update(1);
                 }
+
+                spill(postings);
+            },
+            blockCount);
+
+        threadPool.wait();
+    }
+
+    void write(SearchIndexWriter& writer, const TermDictionary& dictionary) {
+        ProgressBar progressBar(postingCount, fmt::format("Merging {} runs", runs.size()));
+
+        std::vector<FileReader> readers;
+        readers.reserve(runs.size());
+
+        using Head = std::pair<Posting, std::size_t>;
+        auto compareHeads = [](const Head& a, const Head& b) {
+            return a.first > b.first;
+        };
+        std::priority_queue<Head, std::vector<Head>, decltype(compareHeads)> heads(compareHeads);
+
+        for (const auto& run : runs) {
+            auto& reader = readers.emplace_back(run);
+            if (!reader.isEOF()) {
+                heads.emplace(readPosting(reader), readers.size() - 1);
             }
+        }
+
+        // The merge produces the postings of a term in patent id order, so they're written as they are
+        std::vector<std::pair<std::uint32_t, std::uint16_t>> counts;
+        std::uint32_t currentTerm = 0;
 
-            progressBar.update(end - start);
+        while (!heads.empty()) {
+            auto [posting, run] = heads.top();
+            heads.pop();
 
-            std::lock_guard lock(termCountsMutex);
-            for (const auto& [term, counts] : localTermCounts) {
-                termCounts[term].insert(counts.begin(), counts.end());
+            if (posting.term != currentTerm && !counts.empty()) {
+                writer.writeSortedCounts(std::string(dictionary.getTerm(currentTerm)), counts);
+                progressBar.update(counts.size());
+                counts.clear();
             }
-        },
-        threadPool.get_thread_count() * 5);
 
-    threadPool.wait();
+            currentTerm = posting.term;
 
-    for (const auto& [term, counts] : termCounts) {
-        writer.writeCounts(term, counts);
+            // Stores written before duplicate CPC codes were removed can contain a term twice for the same patent,
+            // which would misalign the counts with the bitset
+            if (counts.empty() || counts.back().first != posting.patentId) {
+                counts.emplace_back(posting.patentId, posting.count);
+            }
+
+            if (!readers[run].isEOF()) {
+                heads.emplace(readPosting(readers[run]), run);
+            }
+        }
+
+        if (!counts.empty()) {
+            writer.writeSortedCounts(std::string(dictionary.getTerm(currentTerm)), counts);
+            progressBar.update(counts.size());
+        }
+    }
+
+private:
+    // Writes the buffered postings to a new run sorted by term and patent id, and empties the buffer
+    void spill(std::vector<Posting>& postings) {
+        if (postings.empty()) {
+            return;
+        }
+
+        std::sort(postings.begin(), postings.end());
+
+        std::filesystem::path run;
+        {
+            std::lock_guard lock(runsMutex);
+            run = runsDirectory / fmt::format("run-{}.bin", runs.size());
+            runs.emplace_back(run);
+            postingCount += postings.size();
+        }
+
+        FileWriter runWriter(run);
+        for (const auto& posting : postings) {
+            runWriter.writeScalar<std::uint32_t>(posting.term);
+            runWriter.writeScalar<std::uint32_t>(posting.patentId);
+            runWriter.writeScalar<std::uint16_t>(posting.count);
+        }
+
+        postings.clear();
+    }
+
+    static Posting readPosting(MemoryReader& reader) {
+        auto term = reader.readScalar<std::uint32_t>();
+        auto patentId = reader.readScalar<std::uint32_t>();
+        auto count = reader.readScalar<std::uint16_t>();
+
+        return {term, patentId, count};
+    }
+};
+
+// Wildcard terms cover CPC codes at the section, class, subclass and main group levels of the CPC hierarchy
+constexpr int CPC_ROLLUP_LEVELS = 4;
+
+// Returns the wildcard term covering a CPC term at the given level, or an empty string if the code is too short for it
+// For example, "cpc:H04L9/0643" rolls up into "cpc:H*", "cpc:H04*", "cpc:H04L*" and "cpc:H04L9/*"
+inline std::string getCpcRollupTerm(std::string_view term, int level) {
+    auto code = term.substr(term.find(':') + 1);
+
+    if (level == CPC_ROLLUP_LEVELS - 1) {
+        auto slashIndex = code.find('/');
+        if (slashIndex == std::string_view::npos) {
+            return "";
+        }
+
+        return fmt::format("cpc:{}*", code.substr(0, slashIndex + 1));
     }
+
+    std::size_t length = level == 0 ? 1 : level + 2;
+    if (code.length() < length) {
+        return "";
+    }
+
+    return fmt::format("cpc:{}*", code.substr(0, length));
 }
 
-inline void processTerms(
+// Materializes the wildcard CPC terms, so that searching for them is as cheap as searching for any other term
+// Every level is processed separately to limit how many large bitsets are in memory at once
+// Every block of patents counts its terms into one map per hash partition of the term space, so that blocks never
+// share a map, after which the partitions are merged in parallel and handed to the writer as soon as they're done
+inline void processCpcRollupTerms(
     SearchIndexWriter& writer,
     const PatentReader& patentReader,
     BS::thread_pool& threadPool,
     const std::vector<std::string>& publicationNumbers,
-    const ankerl::unordered_dense::map<std::string, std::uint32_t>& patentIds,
-    TermCategory::TermCategory category) {
-    if (category != TermCategory::Claims && category != TermCategory::Description) {
-        processTermGroup(
-            writer,
-            patentReader,
-            threadPool,
-            publicationNumbers,
-            patentIds,
-            category,
-            {},
-            fmt::format("Processing {} terms", TermCategory::toString(category)));
-        return;
-    }
-
-    ankerl::unordered_dense::map<std::string, std::uint32_t> termCounts;
-    std::mutex termCountsMutex;
-
-    ProgressBar progressBar(
-        publicationNumbers.size(),
-        fmt::format("Collecting {} terms", TermCategory::toString(category)));
+    const ankerl::unordered_dense::map<std::string, std::uint32_t>& patentIds) {
+    using TermCounts =
+        ankerl::unordered_dense::map<std::string, ankerl::unordered_dense::map<std::uint32_t, std::uint16_t>>;
+
+    const auto& dictionary = patentReader.getDictionary();
+
+    std::size_t blockCount = threadPool.get_thread_count() * 5;
+    std::size_t blockSize = (publicationNumbers.size() + blockCount - 1) / blockCount;
+    std::size_t partitionCount = threadPool.get_thread_count() * 4;
+
+    for (int level = 0; level < CPC_ROLLUP_LEVELS; ++level) {
+        std::vector<std::vector<TermCounts>> blockTermCounts(blockCount, std::vector<TermCounts>(partitionCount));
+
+        ProgressBar progressBar(
+            publicationNumbers.size(),
+            fmt::format("Processing cpc rollup terms (level {}/{})", level + 1, CPC_ROLLUP_LEVELS));
+
+        for (std::size_t block = 0; block < blockCount; ++block) {
+            threadPool.detach_task([&, block] {
+                auto start = std::min(block * blockSize, publicationNumbers.size());
+                auto end = std::min(start + blockSize, publicationNumbers.size());
+                auto& partitions = blockTermCounts[block];
+
+                for (std::size_t i = start; i < end; ++i) {
+                    const auto& publicationNumber = publicationNumbers[i];
+                    auto patentId = patentIds.at(publicationNumber);
+
+                    for (auto id : patentReader.readTermIds(publicationNumber, TermCategory::Cpc)) {
+                        auto term = getCpcRollupTerm(dictionary.getTerm(id), level);
+                        if (!term.empty()) {
+                            auto partition = ankerl::unordered_dense::hash<std::string>{}(term) % partitionCount;
+                            ++partitions[partition][term][patentId];
+                        }
+                    }
+                }
 
-    threadPool.detach_blocks(
-        static_cast<std::size_t>(0),
-        publicationNumbers.size(),
-        [&](std::size_t start, std::size_t end) {
-            PatentReader localPatentReader(patentReader);
-            ankerl::unordered_dense::map<std::string, std::uint32_t> localTermCounts;
-
-            for (std::size_t i = start; i < end; ++i) {
-                auto patentTermCounts = localPatentReader.readTermsWithCounts(publicationNumbers[i], category);
-                for (const auto& [term, count] : patentTermCounts) {
-                    localTermCounts[term] += count;
+                progressBar.update(end - start);
+            });
+        }
+
+        threadPool.wait();
+
+        // Blocks cover disjoint patents, so merging a partition only moves counts and never adds them up
+        BoundedQueue<TermCounts> mergedPartitions(threadPool.get_thread_count());
+
+        for (std::size_t partition = 0; partition < partitionCount; ++partition) {
+            threadPool.detach_task([&, partition] {
+                TermCounts termCounts;
+
+                for (auto& partitions : blockTermCounts) {
+                    for (auto& [term, counts] : partitions[partition]) {
+                        auto& mergedCounts = termCounts[term];
+                        mergedCounts.insert(counts.begin(), counts.end());
+                    }
+
+                    partitions[partition] = {};
                 }
-            }
 
-            progressBar.update(end - start);
+                mergedPartitions.push(std::move(termCounts));
+            });
+        }
 
-            std::lock_guard lock(termCountsMutex);
-            for (const auto& [term, count] : localTermCounts) {
-                termCounts[term] += count;
-            }
-        },
-        threadPool.get_thread_count() * 5);
+        TermCounts termCounts;
+        for (std::size_t partition = 0; partition < partitionCount; ++partition) {
+            mergedPartitions.pop(termCounts);
 
-    threadPool.wait();
+            for (const auto& [term, counts] : termCounts) {
+                writer.writeCounts(term, counts);
+            }
+        }
 
-    int groupCount = category == TermCategory::Claims ? 5 : 20;
-    spdlog::info(
-        "Processing {} {} terms in {} groups",
-        termCounts.size(),
-        TermCategory::toString(category),
-        groupCount);
-
-    std::vector<std::pair<std::string, std::uint32_t>> termCountsSorted(termCounts.begin(), termCounts.end());
-    std::sort(
-        termCountsSorted.begin(),
-        termCountsSorted.end(),
-        [](const std::pair<std::string, std::uint32_t>& a, const std::pair<std::string, std::uint32_t>& b) {
-            return a.second < b.second;
-        });
-
-    termCounts.clear();
-
-    for (int i = 0; i < groupCount; ++i) {
-        ankerl::unordered_dense::set<std::string> terms;
-        terms.reserve(termCountsSorted.size() / groupCount);
-        for (std::size_t j = i; j < termCountsSorted.size(); j += groupCount) {
-            terms.emplace(termCountsSorted[j].first);
-        }
-
-        processTermGroup(
-            writer,
-            patentReader,
-            threadPool,
-            publicationNumbers,
-            patentIds,
-            category,
-            terms,
-            fmt::format("Processing {} terms (group {}/{})", TermCategory::toString(category), i + 1, groupCount));
+        threadPool.wait();
     }
 }
 
@@ -364,18 +832,21 @@ inline void createSearchIndex(
     searchIndexWriter.writeIds(patentIds);
 
     BS::thread_pool threadPool;
+    auto blockCount = threadPool.get_thread_count() * 5;
 
-    for (const auto category : std::vector<TermCategory::TermCategory>{
-             TermCategory::Cpc,
-             TermCategory::Title,
-             TermCategory::Abstract,
-             TermCategory::Claims,
-             TermCategory::Description,
-         }) {
-        if (!includeDescription && category == TermCategory::Description) {
-            continue;
-        }
+    auto categories = TermCategory::Cpc | TermCategory::Title | TermCategory::Abstract | TermCategory::Claims;
+    if (includeDescription) {
+        categories = categories | TermCategory::Description;
+    }
 
-        processTerms(searchIndexWriter, patentReader, threadPool, sortedPublicationNumbers, patentIds, category);
+    {
+        PostingsBuilder postingsBuilder(
+            outputDirectory / "runs",
+            getIndexMemoryLimit(),
+            threadPool.get_thread_count());
+        postingsBuilder.collect(patentReader, threadPool, sortedPublicationNumbers, patentIds, categories, blockCount);
+        postingsBuilder.write(searchIndexWriter, patentReader.getDictionary());
     }
+
+    processCpcRollupTerms(searchIndexWriter, patentReader, threadPool, sortedPublicationNumbers, patentIds);
 }
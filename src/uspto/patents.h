@@ -1,350 +1,430 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <filesystem>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <ankerl/unordered_dense.h>
 
 #include <uspto/config.h>
+#include <uspto/dictionary.h>
 #include <uspto/files.h>
 #include <uspto/queries.h>
+#include <uspto/tokenizer.h>
+
+// Every category is stored in its own column file (cpc.bin, ti.bin, ab.bin, clm.bin and detd.bin), so reading some
+// categories of a patent never touches the pages of the others
+// data.bin contains a row per patent with the offset (uint64) and size (uint32) of its chunk in every column, in the
+// same order as the TermCategory bits
+// The CPC chunks contain the number of terms (uint16) followed by their ids (uint32 each)
+// The text chunks contain the number of terms followed by the terms sorted by id, every term is stored as the difference
+// to the previous id and its count, all as variable-length integers
+constexpr std::size_t PATENT_COLUMN_COUNT = 5;
+
+// data.bin and the column files
+constexpr std::size_t PATENT_FILE_COUNT = 1 + PATENT_COLUMN_COUNT;
+
+inline std::size_t getPatentColumn(TermCategory::TermCategory category) {
+    std::size_t column = 0;
+    while ((category >> column) != 1) {
+        ++column;
+    }
+
+    return column;
+}
+
+inline std::filesystem::path getPatentColumnFile(const std::filesystem::path& directory, std::size_t column) {
+    return directory / (TermCategory::toString(static_cast<TermCategory::TermCategory>(1 << column)) + ".bin");
+}
+
+// The small categories which most query generators read, kept in memory by default so that reading them never waits
+// for the disk
+constexpr auto DEFAULT_HOT_CATEGORIES = TermCategory::Cpc | TermCategory::Title | TermCategory::Abstract;
 
 class PatentReader : public DataReader<std::uint8_t> {
+    static constexpr std::uint64_t ROW_SIZE = PATENT_COLUMN_COUNT * 12;
+
+    struct Chunk {
+        std::uint64_t offset;
+        std::uint32_t size;
+    };
+
+    // The column files of every shard
+    std::vector<std::array<std::shared_ptr<MappedFile>, PATENT_COLUMN_COUNT>> columns;
+    TermDictionary dictionary;
+
 public:
-    using DataReader::DataReader;
+    // The columns of the hot categories are loaded into memory up front, along with the rows pointing into them, while
+    // the other columns stay on disk and are paged in on demand
+    explicit PatentReader(
+        const std::filesystem::path& directory,
+        TermCategory::TermCategory hotCategories = DEFAULT_HOT_CATEGORIES)
+        : DataReader(directory, hotCategories != 0),
+          columns(openColumns(directory, hotCategories)),
+          dictionary(directory / "terms") {}
 
     PatentReader() : PatentReader(getReformattedPatentDataDirectory()) {}
 
-    std::vector<std::string> readTerms(const std::string& publicationNumber, TermCategory::TermCategory categories) {
-        seekToKey(publicationNumber);
+    const TermDictionary& getDictionary() const {
+        return dictionary;
+    }
 
-        auto cpcSize = readScalar<std::uint32_t>();
-        auto titleSize = readScalar<std::uint32_t>();
-        auto abstractSize = readScalar<std::uint32_t>();
-        auto claimsSize = readScalar<std::uint32_t>();
+    std::vector<std::uint32_t> readTermIds(
+        const std::string& publicationNumber,
+        TermCategory::TermCategory categories) const {
+        auto location = getIndex().at(publicationNumber);
 
-        auto cpcOffset = getPosition();
-        auto titleOffset = cpcOffset + cpcSize;
-        auto abstractOffset = titleOffset + titleSize;
-        auto claimsOffset = abstractOffset + abstractSize;
-        auto descriptionOffset = claimsOffset + claimsSize;
+        std::vector<std::uint32_t> out;
 
-        std::vector<std::string> out;
+        for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+            if ((categories & (1 << i)) == 0) {
+                continue;
+            }
 
-        if ((categories & TermCategory::Cpc) != 0) {
-            readKeywordTokens(out, cpcOffset, TermCategory::Cpc);
-        }
+            auto reader = getColumnReader(location, i);
 
-        if ((categories & TermCategory::Title) != 0) {
-            readTextTokens(out, titleOffset, TermCategory::Title);
+            if (i == 0) {
+                readKeywordTermIds(out, reader);
+            } else {
+                readTextTermIds(out, reader);
+            }
         }
 
-        if ((categories & TermCategory::Abstract) != 0) {
-            readTextTokens(out, abstractOffset, TermCategory::Abstract);
-        }
+        return out;
+    }
 
-        if ((categories & TermCategory::Claims) != 0) {
-            readTextTokens(out, claimsOffset, TermCategory::Claims);
-        }
+    std::vector<std::pair<std::uint32_t, std::uint16_t>> readTermIdsWithCounts(
+        const std::string& publicationNumber,
+        TermCategory::TermCategory categories) const {
+        auto location = getIndex().at(publicationNumber);
+
+        std::vector<std::pair<std::uint32_t, std::uint16_t>> out;
+
+        for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+            if ((categories & (1 << i)) == 0) {
+                continue;
+            }
 
-        if ((categories & TermCategory::Description) != 0) {
-            readTextTokens(out, descriptionOffset, TermCategory::Description);
+            auto reader = getColumnReader(location, i);
+
+            if (i == 0) {
+                readKeywordTermIdsWithCounts(out, reader);
+            } else {
+                readTextTermIdsWithCounts(out, reader);
+            }
         }
 
         return out;
     }
 
-    ankerl::unordered_dense::map<std::string, std::uint16_t> readTermsWithCounts(
+    std::vector<std::string> readTerms(
         const std::string& publicationNumber,
-        TermCategory::TermCategory categories) {
-        seekToKey(publicationNumber);
+        TermCategory::TermCategory categories) const {
+        auto ids = readTermIds(publicationNumber, categories);
 
-        auto cpcSize = readScalar<std::uint32_t>();
-        auto titleSize = readScalar<std::uint32_t>();
-        auto abstractSize = readScalar<std::uint32_t>();
-        auto claimsSize = readScalar<std::uint32_t>();
+        std::vector<std::string> out;
+        out.reserve(ids.size());
 
-        auto cpcOffset = getPosition();
-        auto titleOffset = cpcOffset + cpcSize;
-        auto abstractOffset = titleOffset + titleSize;
-        auto claimsOffset = abstractOffset + abstractSize;
-        auto descriptionOffset = claimsOffset + claimsSize;
+        for (auto id : ids) {
+            out.emplace_back(dictionary.getTerm(id));
+        }
+
+        return out;
+    }
+
+    ankerl::unordered_dense::map<std::string, std::uint16_t> readTermsWithCounts(
+        const std::string& publicationNumber,
+        TermCategory::TermCategory categories) const {
+        auto idCounts = readTermIdsWithCounts(publicationNumber, categories);
 
         ankerl::unordered_dense::map<std::string, std::uint16_t> out;
+        out.reserve(idCounts.size());
 
-        if ((categories & TermCategory::Cpc) != 0) {
-            readKeywordTokensWithCounts(out, cpcOffset, TermCategory::Cpc);
+        for (const auto& [id, count] : idCounts) {
+            out.emplace(dictionary.getTerm(id), count);
         }
 
-        if ((categories & TermCategory::Title) != 0) {
-            readTextTokensWithCounts(out, titleOffset, TermCategory::Title);
-        }
+        return out;
+    }
 
-        if ((categories & TermCategory::Abstract) != 0) {
-            readTextTokensWithCounts(out, abstractOffset, TermCategory::Abstract);
+    // Starts reading the given categories of all given patents in the background, so that the reads which follow don't
+    // have to wait for the disk one patent at a time
+    void prefetch(const std::vector<std::string>& publicationNumbers, TermCategory::TermCategory categories) const {
+        std::vector<std::uint64_t> locations;
+        locations.reserve(publicationNumbers.size());
+        for (const auto& publicationNumber : publicationNumbers) {
+            locations.emplace_back(getIndex().at(publicationNumber));
         }
 
-        if ((categories & TermCategory::Claims) != 0) {
-            readTextTokensWithCounts(out, claimsOffset, TermCategory::Claims);
-        }
+        std::sort(locations.begin(), locations.end());
 
-        if ((categories & TermCategory::Description) != 0) {
-            readTextTokensWithCounts(out, descriptionOffset, TermCategory::Description);
+        // The rows are needed to know which ranges of the columns to prefetch
+        for (auto location : locations) {
+            DataReader::prefetch(location, ROW_SIZE);
         }
 
-        return out;
+        for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+            if ((categories & (1 << i)) == 0) {
+                continue;
+            }
+
+            for (auto location : locations) {
+                auto chunk = readChunk(location, i);
+                columns[getLocationShard(location)][i]->prefetch(chunk.offset, chunk.size);
+            }
+        }
     }
 
 private:
-    void readKeywordTokens(std::vector<std::string>& out, std::uint64_t offset, TermCategory::TermCategory category) {
-        auto prefix = TermCategory::toString(category) + ":";
-        seek(offset);
+    Chunk readChunk(std::uint64_t location, std::size_t column) const {
+        auto reader = getReader(location);
+        reader.seek(reader.getPosition() + column * 12);
 
-        auto noTokens = readScalar<std::uint16_t>();
-        out.reserve(out.size() + noTokens);
+        auto offset = reader.readScalar<std::uint64_t>();
+        auto size = reader.readScalar<std::uint32_t>();
 
-        // ankerl::unordered_dense::set<std::string> wildcardTokens;
+        return {offset, size};
+    }
 
-        for (std::uint16_t i = 0; i < noTokens; ++i) {
-            auto term = prefix + readString<std::uint8_t>();
-            out.emplace_back(term);
+    MemoryReader getColumnReader(std::uint64_t location, std::size_t column) const {
+        const auto& file = *columns[getLocationShard(location)][column];
+        return MemoryReader(file.getData(), file.getSize(), readChunk(location, column).offset);
+    }
 
-            /*auto slashIndex = term.find('/');
-            if (slashIndex != std::string::npos) {
-                wildcardTokens.insert(term.substr(0, slashIndex) + "/*");
-            }*/
+    static std::vector<std::array<std::shared_ptr<MappedFile>, PATENT_COLUMN_COUNT>> openColumns(
+        const std::filesystem::path& directory,
+        TermCategory::TermCategory hotCategories) {
+        std::vector<std::array<std::shared_ptr<MappedFile>, PATENT_COLUMN_COUNT>> columns;
+
+        for (const auto& shardDirectory : getShardDirectories(directory)) {
+            auto& shardColumns = columns.emplace_back();
+            for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+                shardColumns[i] = std::make_shared<MappedFile>(
+                    getPatentColumnFile(shardDirectory, i),
+                    (hotCategories & (1 << i)) != 0);
+            }
         }
 
-        // out.insert(out.end(), wildcardTokens.begin(), wildcardTokens.end());
+        return columns;
     }
 
-    void readTextTokens(std::vector<std::string>& out, std::uint64_t offset, TermCategory::TermCategory category) {
-        auto prefix = TermCategory::toString(category) + ":";
-        seek(offset);
+    void readKeywordTermIds(std::vector<std::uint32_t>& out, MemoryReader& reader) const {
+        auto noTerms = reader.readScalar<std::uint16_t>();
+        out.reserve(out.size() + noTerms);
 
-        auto noTokens = readScalar<std::uint32_t>();
-        out.reserve(out.size() + noTokens);
-
-        for (std::uint32_t i = 0; i < noTokens; ++i) {
-            out.emplace_back(prefix + readString<std::uint16_t>());
-            readScalar<std::uint16_t>();
+        for (std::uint16_t i = 0; i < noTerms; ++i) {
+            out.emplace_back(reader.readScalar<std::uint32_t>());
         }
     }
 
-    void readKeywordTokensWithCounts(
-        ankerl::unordered_dense::map<std::string, std::uint16_t>& out,
-        std::uint64_t offset,
-        TermCategory::TermCategory category) {
-        auto prefix = TermCategory::toString(category) + ":";
-        seek(offset);
-
-        auto noTokens = readScalar<std::uint16_t>();
-        out.reserve(out.size() + noTokens);
+    void readTextTermIds(std::vector<std::uint32_t>& out, MemoryReader& reader) const {
+        auto noTerms = reader.readVarInt();
+        out.reserve(out.size() + noTerms);
 
-        for (std::uint16_t i = 0; i < noTokens; ++i) {
-            auto term = prefix + readString<std::uint8_t>();
-            out.emplace(term, 1);
+        std::uint32_t id = 0;
+        for (std::uint64_t i = 0; i < noTerms; ++i) {
+            id += reader.readVarInt();
+            reader.readVarInt();
 
-            /*auto slashIndex = term.find('/');
-            if (slashIndex != std::string::npos) {
-                ++out[term.substr(0, slashIndex) + "/*"];
-            }*/
+            out.emplace_back(id);
         }
     }
 
-    void readTextTokensWithCounts(
-        ankerl::unordered_dense::map<std::string, std::uint16_t>& out,
-        std::uint64_t offset,
-        TermCategory::TermCategory category) {
-        auto prefix = TermCategory::toString(category) + ":";
-        seek(offset);
+    void readKeywordTermIdsWithCounts(
+        std::vector<std::pair<std::uint32_t, std::uint16_t>>& out,
+        MemoryReader& reader) const {
+        auto noTerms = reader.readScalar<std::uint16_t>();
+        out.reserve(out.size() + noTerms);
 
-        auto noTokens = readScalar<std::uint32_t>();
-        out.reserve(out.size() + noTokens);
+        for (std::uint16_t i = 0; i < noTerms; ++i) {
+            out.emplace_back(reader.readScalar<std::uint32_t>(), 1);
+        }
+    }
+
+    void readTextTermIdsWithCounts(
+        std::vector<std::pair<std::uint32_t, std::uint16_t>>& out,
+        MemoryReader& reader) const {
+        auto noTerms = reader.readVarInt();
+        out.reserve(out.size() + noTerms);
 
-        for (std::uint32_t i = 0; i < noTokens; ++i) {
-            auto token = readString<std::uint16_t>();
-            auto count = readScalar<std::uint16_t>();
+        std::uint32_t id = 0;
+        for (std::uint64_t i = 0; i < noTerms; ++i) {
+            id += reader.readVarInt();
+            auto count = reader.readVarInt();
 
-            out.emplace(prefix + token, count);
+            out.emplace_back(id, count);
         }
     }
 };
 
 class PatentWriter : public DataWriter<std::uint8_t> {
-    std::array<char, 65536> tokenBlock{};
+    std::array<std::unique_ptr<FileWriter>, PATENT_COLUMN_COUNT> columnWriters;
+
+    std::unique_ptr<TermDictionaryWriter> ownedDictionary;
+    TermDictionaryWriter& dictionary;
+
+    // Reused between patents, so that writing a patent stops allocating once these have grown large enough
+    TextTokenizer tokenizer;
+    ankerl::unordered_dense::map<std::string_view, std::uint16_t> tokenCounts;
+    std::vector<std::uint32_t> keywordIds;
+    std::vector<std::pair<std::uint32_t, std::uint16_t>> textIds;
+
+    std::array<std::string, PATENT_COLUMN_COUNT> termPrefixes;
+    std::string termBuffer;
 
 public:
     PatentWriter() : PatentWriter(getReformattedPatentDataDirectory()) {}
 
+    // Writes a store with its own term dictionary
     explicit PatentWriter(const std::filesystem::path& directory)
-        : DataWriter(directory) {}
+        : DataWriter(directory),
+          columnWriters(openColumnWriters(directory, FileWriter::DEFAULT_BUFFER_SIZE)),
+          ownedDictionary(std::make_unique<TermDictionaryWriter>(directory / "terms")),
+          dictionary(*ownedDictionary),
+          termPrefixes(createTermPrefixes()) {}
+
+    // Writes a shard of a store, the shards of a store share the store's term dictionary
+    // Every one of the PATENT_FILE_COUNT files of a shard is written through two buffers of the given size
+    PatentWriter(
+        const std::filesystem::path& directory,
+        TermDictionaryWriter& dictionary,
+        std::size_t bufferSize = FileWriter::DEFAULT_BUFFER_SIZE)
+        : DataWriter(directory, bufferSize),
+          columnWriters(openColumnWriters(directory, bufferSize)),
+          dictionary(dictionary),
+          termPrefixes(createTermPrefixes()) {}
 
     void writePatent(
-        const std::string& publicationNumber,
+        std::string_view publicationNumber,
         const std::vector<std::string>& cpcCodes,
-        const std::string& title,
-        const std::string& abstract,
-        const std::string& claims,
-        const std::string& description) {
-        auto titleTokens = compressTextTokens(extractTextTokens(title));
-        auto abstractTokens = compressTextTokens(extractTextTokens(abstract));
-        auto claimsTokens = compressTextTokens(extractTextTokens(claims));
-        auto descriptionTokens = compressTextTokens(extractTextTokens(description));
-
-        auto cpcSize = getKeywordChunkSize(cpcCodes);
-        auto titleSize = getTextChunkSize(titleTokens);
-        auto abstractSize = getTextChunkSize(abstractTokens);
-        auto claimsSize = getTextChunkSize(claimsTokens);
-
+        std::string_view title,
+        std::string_view abstract,
+        std::string_view claims,
+        std::string_view description) {
         addKey(publicationNumber);
 
-        writeScalar<std::uint32_t>(cpcSize);
-        writeScalar<std::uint32_t>(titleSize);
-        writeScalar<std::uint32_t>(abstractSize);
-        writeScalar<std::uint32_t>(claimsSize);
-
-        writeKeywordTokens(cpcCodes);
-        writeTextTokens(titleTokens);
-        writeTextTokens(abstractTokens);
-        writeTextTokens(claimsTokens);
-        writeTextTokens(descriptionTokens);
+        writeKeywordTerms(TermCategory::Cpc, cpcCodes);
+        writeTextTerms(TermCategory::Title, title);
+        writeTextTerms(TermCategory::Abstract, abstract);
+        writeTextTerms(TermCategory::Claims, claims);
+        writeTextTerms(TermCategory::Description, description);
     }
 
     // Only used internally, but publicly exposed for unit tests
     std::vector<std::string> extractTextTokens(const std::string& text) {
         std::vector<std::string> tokens;
 
-        std::size_t tokenLength = 0;
+        tokenizer.tokenize(text, [&](std::string_view token) {
+            tokens.emplace_back(token);
+        });
 
-        std::size_t textLength = text.length();
-        auto* textChars = text.data();
+        return tokens;
+    }
 
-        for (std::size_t i = 0; i < textLength; ++i) {
-            char ch = textChars[i];
+private:
+    static std::array<std::string, PATENT_COLUMN_COUNT> createTermPrefixes() {
+        std::array<std::string, PATENT_COLUMN_COUNT> prefixes;
 
-            if (!isWordCharacter(ch)
-                && !(tokenLength > 0 && ch == '.' && i < textLength - 1 && isWordCharacter(textChars[i + 1]))) {
-                if (tokenLength > 1) {
-                    std::string token(tokenBlock.data(), tokenBlock.data() + tokenLength);
+        for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+            prefixes[i] = TermCategory::toString(static_cast<TermCategory::TermCategory>(1 << i)) + ":";
+        }
 
-                    if (!isForbiddenToken(token)) {
-                        tokens.emplace_back(std::move(token));
-                    }
-                }
+        return prefixes;
+    }
 
-                tokenLength = 0;
-            } else {
-                tokenBlock[tokenLength++] = toLower(ch);
-            }
-        }
+    std::uint32_t getTermId(TermCategory::TermCategory category, std::string_view token) {
+        termBuffer.assign(termPrefixes[getPatentColumn(category)]).append(token);
+        return dictionary.getId(termBuffer);
+    }
 
-        if (tokenLength > 1) {
-            std::string token(tokenBlock.data(), tokenBlock.data() + tokenLength);
+    void writeKeywordTerms(TermCategory::TermCategory category, const std::vector<std::string>& tokens) {
+        keywordIds.clear();
 
-            if (!isForbiddenToken(token)) {
-                tokens.emplace_back(std::move(token));
+        // Some patents list a CPC code more than once, a term occurs in a patent at most once
+        for (const auto& token : tokens) {
+            auto id = getTermId(category, token);
+            if (std::find(keywordIds.begin(), keywordIds.end(), id) == keywordIds.end()) {
+                keywordIds.emplace_back(id);
             }
         }
 
-        return tokens;
+        writeKeywordTermIds(category, keywordIds);
     }
 
-private:
-    bool isWordCharacter(char ch) const {
-        return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
-    }
+    // Tokens are counted as views into the tokenizer's buffer, which stays valid until the next text is tokenized
+    void writeTextTerms(TermCategory::TermCategory category, std::string_view text) {
+        tokenCounts.clear();
 
-    char toLower(char ch) const {
-        if (ch >= 'A' && ch <= 'Z') {
-            return static_cast<char>(ch + 32);
-        }
-
-        return ch;
-    }
+        tokenizer.tokenize(text, [&](std::string_view token) {
+            ++tokenCounts[token];
+        });
 
-    bool isForbiddenToken(const std::string& token) const {
-        bool hasNonDecimal = false;
-        int periodCount = 0;
+        textIds.clear();
 
-        for (char ch : token) {
-            if (ch == '.') {
-                ++periodCount;
-            } else if (ch < '0' || ch > '9') {
-                hasNonDecimal = true;
-                break;
-            }
+        for (const auto& [token, count] : tokenCounts) {
+            textIds.emplace_back(getTermId(category, token), count);
         }
 
-        if (!hasNonDecimal && periodCount < 2) {
-            return true;
-        }
+        // Sorted, so that the ids can be stored as small differences
+        std::sort(textIds.begin(), textIds.end());
 
-        auto tokenLength = token.length();
-        return (tokenLength == 2 && (token == "an" || token == "by" || token == "if"
-                                     || token == "is" || token == "no" || token == "of"
-                                     || token == "on" || token == "to"))
-               || (tokenLength == 3 && (token == "are" || token == "for" || token == "not"
-                                        || token == "the" || token == "was"))
-               || (tokenLength == 4 && (token == "into" || token == "such" || token == "that"
-                                        || token == "then" || token == "they" || token == "this"
-                                        || token == "will"))
-               || (tokenLength == 5 && (token == "their" || token == "there" || token == "these"));
+        writeTextTermIds(category, textIds);
     }
 
-    ankerl::unordered_dense::map<std::string, std::uint16_t> compressTextTokens(
-        const std::vector<std::string>& tokens) const {
-        ankerl::unordered_dense::map<std::string, std::uint16_t> count;
+    static std::array<std::unique_ptr<FileWriter>, PATENT_COLUMN_COUNT> openColumnWriters(
+        const std::filesystem::path& directory,
+        std::size_t bufferSize) {
+        std::array<std::unique_ptr<FileWriter>, PATENT_COLUMN_COUNT> writers;
 
-        for (const auto& token : tokens) {
-            ++count[token];
+        for (std::size_t i = 0; i < PATENT_COLUMN_COUNT; ++i) {
+            writers[i] = std::make_unique<FileWriter>(getPatentColumnFile(directory, i), bufferSize);
         }
 
-        return count;
+        return writers;
     }
 
-    std::uint32_t getKeywordChunkSize(const std::vector<std::string>& tokens) const {
-        // Number of tokens (uint16)
-        std::uint32_t size = 2;
+    void writeKeywordTermIds(TermCategory::TermCategory category, const std::vector<std::uint32_t>& ids) {
+        auto& writer = *columnWriters[getPatentColumn(category)];
+        auto offset = writer.getPosition();
 
-        for (const auto& token : tokens) {
-            // Length of token (uint8) + token (byte per character)
-            size += 1 + token.size();
+        writer.writeScalar<std::uint16_t>(ids.size());
+
+        for (auto id : ids) {
+            writer.writeScalar<std::uint32_t>(id);
         }
 
-        return size;
+        writeChunk(offset, writer.getPosition() - offset);
     }
 
-    std::uint32_t getTextChunkSize(const ankerl::unordered_dense::map<std::string, std::uint16_t>& tokens) const {
-        // Number of tokens (uint32)
-        std::uint32_t size = 4;
-
-        for (const auto& pair : tokens) {
-            // Length of token (uint16) + token (byte per character) + token count (uint16)
-            size += 4 + pair.first.size();
-        }
+    void writeTextTermIds(
+        TermCategory::TermCategory category,
+        const std::vector<std::pair<std::uint32_t, std::uint16_t>>& ids) {
+        auto& writer = *columnWriters[getPatentColumn(category)];
+        auto offset = writer.getPosition();
 
-        return size;
-    }
+        writer.writeVarInt(ids.size());
 
-    void writeKeywordTokens(const std::vector<std::string>& tokens) {
-        writeScalar<std::uint16_t>(tokens.size());
+        std::uint32_t previousId = 0;
+        for (const auto& [id, count] : ids) {
+            writer.writeVarInt(id - previousId);
+            writer.writeVarInt(count);
 
-        for (const auto& token : tokens) {
-            writeString<std::uint8_t>(token);
+            previousId = id;
         }
-    }
 
-    void writeTextTokens(const ankerl::unordered_dense::map<std::string, std::uint16_t>& tokens) {
-        writeScalar<std::uint32_t>(tokens.size());
+        writeChunk(offset, writer.getPosition() - offset);
+    }
 
-        for (const auto& [token, count] : tokens) {
-            writeString<std::uint16_t>(token);
-            writeScalar<std::uint16_t>(count);
-        }
+    // Appends the location of a chunk to the patent's row in data.bin
+    void writeChunk(std::uint64_t offset, std::uint64_t size) {
+        writeScalar<std::uint64_t>(offset);
+        writeScalar<std::uint32_t>(size);
     }
 };
@@ -14,7 +14,7 @@ enum TermCategory {
     Description = 16,
 };
 
-inline TermCategory operator|(TermCategory a, TermCategory b) {
+constexpr TermCategory operator|(TermCategory a, TermCategory b) {
     return static_cast<TermCategory>(static_cast<int>(a) | static_cast<int>(b));
 }
 
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Hands items from producer threads to consumer threads, push() blocks while the queue is full so that a fast
+// producer can't run arbitrarily far ahead of its consumers
+// Every item has a weight (1 by default), the queue is full once the weights of its items add up to its capacity
+// An item is always accepted by an empty queue, even when it is heavier than the capacity
+template<typename T>
+class BoundedQueue {
+    std::size_t capacity;
+
+    std::deque<std::pair<T, std::size_t>> items;
+    std::size_t weight;
+    bool closed;
+
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+
+public:
+    explicit BoundedQueue(std::size_t capacity)
+        : capacity(capacity), weight(0), closed(false) {}
+
+    // Returns false without adding the item when the queue has been closed, so that a producer stops once its
+    // consumers have given up
+    bool push(T item, std::size_t itemWeight = 1) {
+        {
+            std::unique_lock lock(mutex);
+            notFull.wait(lock, [&] { return items.empty() || weight + itemWeight <= capacity || closed; });
+
+            if (closed) {
+                return false;
+            }
+
+            items.emplace_back(std::move(item), itemWeight);
+            weight += itemWeight;
+        }
+
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available, returns false once the queue is closed and all items have been popped
+    bool pop(T& item) {
+        {
+            std::unique_lock lock(mutex);
+            notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+
+            if (items.empty()) {
+                return false;
+            }
+
+            item = std::move(items.front().first);
+            weight -= items.front().second;
+            items.pop_front();
+        }
+
+        notFull.notify_one();
+        return true;
+    }
+
+    // Called by the producer after pushing its last item, or by a consumer which fails so that the producer doesn't
+    // wait forever for room in the queue
+    void close() {
+        {
+            std::lock_guard lock(mutex);
+            closed = true;
+        }
+
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
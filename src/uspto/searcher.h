@@ -2,7 +2,6 @@
 
 #include <algorithm>
 #include <any>
-#include <cmath>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -32,7 +31,7 @@ class Searcher {
             : searcher(searcher) {}
 
         std::any visitTerm(whoosh::WhooshParser::TermContext* ctx) override {
-            return searcher.searchIndex.getTermBitset(ctx->TOKEN(0)->toString() + ":" + ctx->TOKEN(1)->toString());
+            return *searcher.searchIndex.getTermBitset(ctx->TOKEN(0)->toString() + ":" + ctx->TOKEN(1)->toString());
         }
 
         std::any visitTermExpr(whoosh::WhooshParser::TermExprContext* ctx) override {
@@ -76,11 +75,7 @@ class Searcher {
         void enterTerm(whoosh::WhooshParser::TermContext* ctx) override {
             auto term = ctx->TOKEN(0)->toString() + ":" + ctx->TOKEN(1)->toString();
 
-            double patentCount = searcher.searchIndex.getPatentCount();
-            double termFrequency = searcher.searchIndex.getTermCardinality(term);
-            double idf = std::log(patentCount / (termFrequency + 1)) + 1;
-
-            terms[term] += idf;
+            terms[term] += searcher.searchIndex.getTermIdf(term);
         }
     };
 
@@ -151,22 +146,49 @@ public:
         TermCollector termCollector(*this);
         antlr4::tree::ParseTreeWalker::DEFAULT.walk(&termCollector, tree);
 
-        std::vector<SearchResult> results(50);
-        std::size_t resultsSize = 0;
+        // A term's counts are stored at the positions of the patent ids in its bitset
+        // Bitsets which aren't much larger than the matching ids are walked alongside the sorted ids, larger ones (like
+        // those of common terms) are searched once per matching id instead of iterating over millions of ids
+        std::vector<double> tfIdfScores(matchingPatentIds.size());
+
+        for (const auto& [term, idf] : termCollector.terms) {
+            auto counts = searchIndex.getTermCounts(term);
+            auto bitset = searchIndex.getTermBitset(term);
+
+            if (counts->size() > matchingPatentIds.size() * 4) {
+                for (std::size_t i = 0; i < matchingPatentIds.size(); ++i) {
+                    auto id = matchingPatentIds[i];
+                    if (bitset->contains(id)) {
+                        tfIdfScores[i] += static_cast<double>((*counts)[bitset->rank(id) - 1]) * idf;
+                    }
+                }
+
+                continue;
+            }
 
-        for (const auto& id : matchingPatentIds) {
-            double tfIdf = 0;
+            auto it = bitset->begin();
+            auto end = bitset->end();
+            std::size_t countIndex = 0;
 
-            for (const auto& [term, idf] : termCollector.terms) {
-                const auto& counts = searchIndex.getTermCounts(term);
+            for (std::size_t i = 0; i < matchingPatentIds.size() && it != end; ++i) {
+                auto id = matchingPatentIds[i];
 
-                auto countsIt = counts.find(id);
-                if (countsIt != counts.end()) {
-                    tfIdf += static_cast<double>(countsIt->second) * idf;
+                while (it != end && *it < id) {
+                    ++it;
+                    ++countIndex;
+                }
+
+                if (it != end && *it == id) {
+                    tfIdfScores[i] += static_cast<double>((*counts)[countIndex]) * idf;
                 }
             }
+        }
+
+        std::vector<SearchResult> results(50);
+        std::size_t resultsSize = 0;
 
-            SearchResult result(id, tfIdf);
+        for (std::size_t i = 0; i < matchingPatentIds.size(); ++i) {
+            SearchResult result(matchingPatentIds[i], tfIdfScores[i]);
             mmheap::heap_insert_circular(result, results.data(), resultsSize, results.size());
         }
 
@@ -37,7 +37,7 @@ struct Task {
 
     void tryGenerator(
         const std::unique_ptr<QueryGenerator>& queryGenerator,
-        PatentReader& patentReader,
+        const PatentReader& patentReader,
         SearchIndex& searchIndex,
         Searcher& searcher,
         GrafanaReporter& reporter) {
@@ -85,6 +85,14 @@ inline std::vector<Task> generateQueries(const std::filesystem::path& testDataFi
     spdlog::info("Creating query generators");
     auto queryGenerators = createQueryGenerators();
 
+    auto prefetchCategories = queryGenerators[0]->getCategories();
+    for (const auto& queryGenerator : queryGenerators) {
+        prefetchCategories = prefetchCategories | queryGenerator->getCategories();
+    }
+
+    spdlog::info("Creating search index");
+    SearchIndex searchIndex(searchIndexReader);
+
     BS::thread_pool threadPool;
     std::mutex mutex;
 
@@ -102,19 +110,23 @@ inline std::vector<Task> generateQueries(const std::filesystem::path& testDataFi
         static_cast<std::size_t>(0),
         tasks.size(),
         [&](std::size_t start, std::size_t end) {
-            PatentReader localPatentReader(patentReader);
-
-            SearchIndex searchIndex(searchIndexReader);
             Searcher searcher(searchIndex, patentIdsReversed);
 
             GrafanaReporter reporter;
 
+            patentReader.prefetch(tasks[start].targets, prefetchCategories);
+
             for (std::size_t i = start; i < end; ++i) {
                 Timer localTimer;
                 auto& task = tasks[i];
 
+                // Reading the next task's patents from disk overlaps with generating queries for this task
+                if (i + 1 < end) {
+                    patentReader.prefetch(tasks[i + 1].targets, prefetchCategories);
+                }
+
                 for (const auto& queryGenerator : queryGenerators) {
-                    task.tryGenerator(queryGenerator, localPatentReader, searchIndex, searcher, reporter);
+                    task.tryGenerator(queryGenerator, patentReader, searchIndex, searcher, reporter);
 
                     // The submission notebook may run for up to 9 hours
                     // It's ran in an environment with 4 CPUs and there are 2,500 tasks to process
@@ -125,7 +137,6 @@ inline std::vector<Task> generateQueries(const std::filesystem::path& testDataFi
                         break;
                     }
 
-                    searchIndex.clearCache();
                     searcher.clearCache();
                 }
 
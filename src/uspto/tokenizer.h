@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// SSE2 is part of x86-64, so the vectorized path is used on every x86-64 build without any extra compiler flags
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace StopWords {
+constexpr std::array<std::string_view, 23> WORDS = {
+    "an", "by", "if", "is", "no", "of", "on", "to",
+    "are", "for", "not", "the", "was",
+    "into", "such", "that", "then", "they", "this", "will",
+    "their", "there", "these"};
+
+// Stop words are 2 to 5 characters long, so each one fits in an integer which is hashed into a collision-free table
+constexpr std::uint64_t HASH_MULTIPLIER = 0x9AD6E98FED058DB3;
+constexpr int HASH_BITS = 5;
+
+constexpr std::uint64_t pack(std::string_view word) {
+    std::uint64_t key = 0;
+    for (std::size_t i = 0; i < word.size(); ++i) {
+        key |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(word[i])) << (8 * i);
+    }
+
+    return key;
+}
+
+constexpr std::size_t hash(std::uint64_t key) {
+    return (key * HASH_MULTIPLIER) >> (64 - HASH_BITS);
+}
+
+constexpr std::array<std::uint64_t, 1 << HASH_BITS> createTable() {
+    std::array<std::uint64_t, 1 << HASH_BITS> table{};
+    for (auto word : WORDS) {
+        table[hash(pack(word))] = pack(word);
+    }
+
+    return table;
+}
+
+constexpr std::array<std::uint64_t, 1 << HASH_BITS> TABLE = createTable();
+
+constexpr bool isCollisionFree() {
+    for (auto word : WORDS) {
+        if (TABLE[hash(pack(word))] != pack(word)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static_assert(isCollisionFree(), "The stop word hash has collisions, pick another multiplier");
+
+constexpr bool contains(std::string_view token) {
+    if (token.size() < 2 || token.size() > 5) {
+        return false;
+    }
+
+    auto key = pack(token);
+    return TABLE[hash(key)] == key;
+}
+}
+
+// Splits text into lowercase tokens of word characters, which may contain periods as long as a word character follows
+// The text is lowercased and classified a vector register at a time, after which tokens are found by skipping over
+// whole runs of word characters in the resulting bitmask
+// Tokens are views into an internal buffer, which stays valid until the next call to tokenize()
+class TextTokenizer {
+    std::string lowercase;
+    std::vector<std::uint8_t> wordMask;
+
+public:
+    template<typename Callback>
+    void tokenize(std::string_view text, Callback&& onToken) {
+        classify(text);
+
+        auto length = text.size();
+        std::size_t start = 0;
+
+        while (start < length) {
+            start = findNext(start, true);
+            if (start >= length) {
+                break;
+            }
+
+            auto end = findNext(start, false);
+
+            // Periods between word characters are part of the token
+            while (end + 1 < length && lowercase[end] == '.' && isWordCharacter(end + 1)) {
+                end = findNext(end + 1, false);
+            }
+
+            std::string_view token(lowercase.data() + start, end - start);
+            if (token.size() > 1 && !isForbiddenToken(token)) {
+                onToken(token);
+            }
+
+            start = end;
+        }
+    }
+
+    static bool isForbiddenToken(std::string_view token) {
+        bool hasNonDecimal = false;
+        int periodCount = 0;
+
+        for (char ch : token) {
+            if (ch == '.') {
+                ++periodCount;
+            } else if (ch < '0' || ch > '9') {
+                hasNonDecimal = true;
+                break;
+            }
+        }
+
+        if (!hasNonDecimal && periodCount < 2) {
+            return true;
+        }
+
+        return StopWords::contains(token);
+    }
+
+private:
+    bool isWordCharacter(std::size_t i) const {
+        return (wordMask[i / 8] >> (i % 8)) & 1;
+    }
+
+    // Returns the position of the first character at or after the given position which is (or isn't) a word character
+    std::size_t findNext(std::size_t position, bool wordCharacter) const {
+        auto length = lowercase.size();
+
+        while (position < length) {
+            std::uint64_t bits;
+            std::memcpy(&bits, wordMask.data() + position / 64 * 8, sizeof(bits));
+
+            if (!wordCharacter) {
+                bits = ~bits;
+            }
+
+            bits &= ~static_cast<std::uint64_t>(0) << (position % 64);
+
+            if (bits != 0) {
+                return std::min(position / 64 * 64 + __builtin_ctzll(bits), length);
+            }
+
+            position = (position / 64 + 1) * 64;
+        }
+
+        return length;
+    }
+
+    // Fills lowercase with the lowercased text and wordMask with a bit per character which is set for word characters
+    void classify(std::string_view text) {
+        auto length = text.size();
+
+        // The mask is padded to whole 64-bit words so that findNext() never reads past its end
+        lowercase.resize(length);
+        wordMask.assign((length + 63) / 64 * 8, 0);
+
+        std::size_t i = 0;
+
+#if defined(__SSE2__)
+        for (; i + 16 <= length; i += 16) {
+            auto chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+
+            auto isUpper = _mm_and_si128(
+                _mm_cmpgt_epi8(chars, _mm_set1_epi8('A' - 1)),
+                _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), chars));
+            auto lower = _mm_or_si128(chars, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+
+            auto isLetter = _mm_and_si128(
+                _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+            auto isDigit = _mm_and_si128(
+                _mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+                _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), chars));
+            auto isUnderscore = _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'));
+
+            auto isWord = _mm_or_si128(_mm_or_si128(isLetter, isDigit), isUnderscore);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lowercase.data() + i), lower);
+
+            auto mask = static_cast<std::uint16_t>(_mm_movemask_epi8(isWord));
+            std::memcpy(wordMask.data() + i / 8, &mask, sizeof(mask));
+        }
+#endif
+
+        for (; i < length; ++i) {
+            char ch = text[i];
+
+            if (ch >= 'A' && ch <= 'Z') {
+                ch = static_cast<char>(ch + 32);
+            }
+
+            lowercase[i] = ch;
+
+            if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '_') {
+                wordMask[i / 8] |= 1 << (i % 8);
+            }
+        }
+    }
+};
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <string>
 
 #include <ankerl/unordered_dense.h>
@@ -12,12 +13,12 @@ int main() {
     PatentReader patentReader;
 
     spdlog::info("Copying publication numbers from patent index");
-    auto index = patentReader.getIndex();
+    const auto& index = patentReader.getIndex();
 
     ankerl::unordered_dense::set<std::string> publicationNumbers;
-    publicationNumbers.reserve(index->size());
-    for (const auto& [publicationNumber, _] : *index) {
-        publicationNumbers.emplace(publicationNumber);
+    publicationNumbers.reserve(index.size());
+    for (std::uint64_t i = 0; i < index.size(); ++i) {
+        publicationNumbers.emplace(index.getKey(i));
     }
 
     createSearchIndex(publicationNumbers, getFullIndexDirectory(), patentReader, false);
@@ -1,9 +1,12 @@
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <future>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -14,8 +17,11 @@
 #include <spdlog/spdlog.h>
 
 #include <uspto/config.h>
+#include <uspto/dictionary.h>
+#include <uspto/files.h>
 #include <uspto/patents.h>
 #include <uspto/progress.h>
+#include <uspto/queue.h>
 
 using CpcCodesMap = ankerl::unordered_dense::map<std::string, std::vector<std::string>>;
 
@@ -35,6 +41,67 @@ std::unique_ptr<duckdb::MaterializedQueryResult> queryDuckDB(
     return std::move(result);
 }
 
+// Reads the cells of a VARCHAR column straight from the chunk's vector, without boxing each one into a duckdb::Value
+// The returned views are valid for as long as the chunk is, NULL cells are read as empty strings
+class StringColumn {
+    duckdb::UnifiedVectorFormat format;
+    const duckdb::string_t* strings;
+
+public:
+    StringColumn(duckdb::DataChunk& chunk, duckdb::idx_t column) {
+        chunk.data[column].ToUnifiedFormat(chunk.size(), format);
+        strings = duckdb::UnifiedVectorFormat::GetData<duckdb::string_t>(format);
+    }
+
+    std::string_view get(duckdb::idx_t row) const {
+        auto index = format.sel->get_index(row);
+        if (!format.validity.RowIsValid(index)) {
+            return {};
+        }
+
+        return {strings[index].GetData(), strings[index].GetSize()};
+    }
+};
+
+// Reads the cells of a VARCHAR[] column straight from the chunk's list and child vectors
+class StringListColumn {
+    duckdb::UnifiedVectorFormat format;
+    const duckdb::list_entry_t* entries;
+
+    duckdb::UnifiedVectorFormat childFormat;
+    const duckdb::string_t* childStrings;
+
+public:
+    StringListColumn(duckdb::DataChunk& chunk, duckdb::idx_t column) {
+        auto& vector = chunk.data[column];
+        vector.ToUnifiedFormat(chunk.size(), format);
+        entries = duckdb::UnifiedVectorFormat::GetData<duckdb::list_entry_t>(format);
+
+        auto& child = duckdb::ListVector::GetEntry(vector);
+        child.ToUnifiedFormat(duckdb::ListVector::GetListSize(vector), childFormat);
+        childStrings = duckdb::UnifiedVectorFormat::GetData<duckdb::string_t>(childFormat);
+    }
+
+    void get(duckdb::idx_t row, std::vector<std::string>& out) const {
+        out.clear();
+
+        auto index = format.sel->get_index(row);
+        if (!format.validity.RowIsValid(index)) {
+            return;
+        }
+
+        const auto& entry = entries[index];
+        out.reserve(entry.length);
+
+        for (duckdb::idx_t i = entry.offset; i < entry.offset + entry.length; ++i) {
+            auto childIndex = childFormat.sel->get_index(i);
+            if (childFormat.validity.RowIsValid(childIndex)) {
+                out.emplace_back(childStrings[childIndex].GetData(), childStrings[childIndex].GetSize());
+            }
+        }
+    }
+};
+
 CpcCodesMap getCpcCodesByPatent() {
     spdlog::info("Extracting CPC codes from patent_metadata.parquet");
 
@@ -69,15 +136,11 @@ CpcCodesMap getCpcCodesByPatent() {
                     CpcCodesMap map;
                     map.reserve(chunk.size());
 
-                    for (std::size_t i = 0; i < chunk.size(); ++i) {
-                        auto publicationNumber = chunk.GetValue(0, i).GetValue<std::string>();
-                        auto cpcCodes = duckdb::ListValue::GetChildren(chunk.GetValue(1, i));
+                    StringColumn publicationNumbers(chunk, 0);
+                    StringListColumn cpcCodes(chunk, 1);
 
-                        auto& cpcVec = map[publicationNumber];
-                        cpcVec.reserve(cpcCodes.size());
-                        for (const auto& value : cpcCodes) {
-                            cpcVec.emplace_back(value.GetValue<std::string>());
-                        }
+                    for (std::size_t i = 0; i < chunk.size(); ++i) {
+                        cpcCodes.get(i, map[std::string(publicationNumbers.get(i))]);
                     }
 
                     progressBar.update(chunk.size());
@@ -96,58 +159,293 @@ CpcCodesMap getCpcCodesByPatent() {
     return cpcCodesByPatent;
 }
 
-void processPatentDataFiles(const CpcCodesMap& cpcCodesByPatent) {
-    std::vector<std::filesystem::path> files;
-    std::copy(
-        std::filesystem::directory_iterator(getCompetitionDataDirectory() / "patent_data"),
-        std::filesystem::directory_iterator(),
-        std::back_inserter(files));
-    std::sort(files.begin(), files.end());
+// Returns the number of bytes taken up by the text columns of a patent data chunk
+std::uint64_t getChunkSize(duckdb::DataChunk& chunk) {
+    std::uint64_t size = 0;
 
-    ProgressBar progressBar(cpcCodesByPatent.size(), "Processing patents");
+    for (duckdb::idx_t column = 0; column < 5; ++column) {
+        StringColumn strings(chunk, column);
+        for (duckdb::idx_t row = 0; row < chunk.size(); ++row) {
+            size += strings.get(row).size();
+        }
+    }
 
+    return size;
+}
+
+// Streams the patent data files chunk by chunk on the calling thread, the chunks are owned by the queue's consumers
+// once pushed
+// The memory limit only covers DuckDB's own buffers, the chunks waiting in the queue are bounded by the queue
+void scanPatentDataFiles(
+    const std::vector<std::filesystem::path>& files,
+    BoundedQueue<std::unique_ptr<duckdb::DataChunk>>& chunks,
+    std::uint64_t memoryLimit,
+    ProgressBar& progressBar) {
     duckdb::DuckDB db(nullptr);
     duckdb::Connection connection(db);
 
-    PatentWriter writer;
+    queryDuckDB(connection, "SET memory_limit = '{}MB'", memoryLimit / 1024 / 1024);
 
-    ankerl::unordered_dense::set<std::string> writtenPublicationNumbers;
-    writtenPublicationNumbers.reserve(cpcCodesByPatent.size());
+    // Rows are spread over the shards in whatever order they arrive in, so DuckDB doesn't have to buffer them to keep
+    // them in file order
+    queryDuckDB(connection, "SET preserve_insertion_order = false");
 
     for (const auto& file : files) {
         progressBar.setDescription(fmt::format("Processing patents: {}", file.filename().generic_string()));
 
-        auto patentData = queryDuckDB(connection, "SELECT * FROM read_parquet('{}')", file.generic_string());
-        for (const auto& chunk : patentData->Collection().Chunks()) {
-            for (std::size_t i = 0; i < chunk.size(); ++i) {
-                auto publicationNumber = chunk.GetValue(0, i).GetValue<std::string>();
-                const auto& cpcCodes = cpcCodesByPatent.at(publicationNumber);
-                auto title = chunk.GetValue(1, i).GetValue<std::string>();
-                auto abstract = chunk.GetValue(2, i).GetValue<std::string>();
-                auto claims = chunk.GetValue(3, i).GetValue<std::string>();
-                auto description = chunk.GetValue(4, i).GetValue<std::string>();
-
-                writer.writePatent(publicationNumber, cpcCodes, title, abstract, claims, description);
-                writtenPublicationNumbers.emplace(publicationNumber);
+        auto query = fmt::format("SELECT * FROM read_parquet('{}')", file.generic_string());
+        auto patentData = connection.SendQuery(query);
+
+        while (true) {
+            auto chunk = patentData->Fetch();
+            if (patentData->HasError()) {
+                spdlog::error("Running '{}' query failed: {}", query, patentData->GetError());
+                std::exit(1);
+            }
+
+            if (chunk == nullptr || chunk->size() == 0) {
+                break;
             }
 
-            progressBar.update(chunk.size());
+            // The queue is only closed early when a consumer failed, its exception is reported by the caller
+            auto size = getChunkSize(*chunk);
+            if (!chunks.push(std::move(chunk), size)) {
+                return;
+            }
         }
     }
 
-    progressBar.setDescription("Processing patents without text");
+    chunks.close();
+}
+
+// manifest.txt lists every patent data file in the store with the checksum of its contents, one per line
+using Manifest = ankerl::unordered_dense::map<std::string, std::string>;
+
+Manifest readManifest(const std::filesystem::path& file) {
+    Manifest manifest;
+
+    std::ifstream in(file);
+    std::string name;
+    std::string checksum;
+    while (in >> name >> checksum) {
+        manifest.emplace(name, checksum);
+    }
+
+    return manifest;
+}
+
+void writeManifest(const std::filesystem::path& file, const Manifest& manifest) {
+    std::vector<std::pair<std::string, std::string>> entries(manifest.begin(), manifest.end());
+    std::sort(entries.begin(), entries.end());
 
-    // For 93 patents there is no row in their corresponding patent data file
-    for (const auto& [publicationNumber, cpcCodes] : cpcCodesByPatent) {
-        if (!writtenPublicationNumbers.contains(publicationNumber)) {
-            writer.writePatent(publicationNumber, cpcCodes, "", "", "", "");
-            progressBar.update(1);
+    std::ofstream out(file);
+    for (const auto& [name, checksum] : entries) {
+        out << name << " " << checksum << "\n";
+    }
+}
+
+std::string getFileChecksum(const std::filesystem::path& file) {
+    MappedFile mappedFile(file);
+    std::string_view contents(mappedFile.getData(), mappedFile.getSize());
+
+    return fmt::format("{:016x}", ankerl::unordered_dense::hash<std::string_view>{}(contents));
+}
+
+// Patent data files are scanned on a separate thread while up to every thread of the pool tokenizes the scanned chunks
+// into its own shard, the shard writers flush to disk in the background
+// The queue between them is bounded by bytes, so scanning can't hold more than the memory limit when it outpaces
+// tokenizing
+// In append mode only the files which are not in the store's manifest yet are processed, into new shards which share
+// the existing term dictionary
+void processPatentDataFiles(const CpcCodesMap& cpcCodesByPatent, bool append) {
+    std::vector<std::filesystem::path> allFiles;
+    std::copy(
+        std::filesystem::directory_iterator(getCompetitionDataDirectory() / "patent_data"),
+        std::filesystem::directory_iterator(),
+        std::back_inserter(allFiles));
+    std::sort(allFiles.begin(), allFiles.end());
+
+    auto outputDirectory = getReformattedPatentDataDirectory();
+    auto manifestFile = outputDirectory / "manifest.txt";
+
+    if (append && !std::filesystem::exists(manifestFile)) {
+        spdlog::error("{} does not exist, run without --append first", manifestFile.generic_string());
+        std::exit(1);
+    }
+
+    if (!append) {
+        spdlog::info("Removing existing patent data in {}", outputDirectory.generic_string());
+        std::filesystem::remove_all(outputDirectory);
+    }
+
+    auto manifest = append ? readManifest(manifestFile) : Manifest();
+
+    std::vector<std::filesystem::path> files;
+    for (const auto& file : allFiles) {
+        auto name = file.filename().generic_string();
+        auto checksum = getFileChecksum(file);
+
+        auto it = manifest.find(name);
+        if (it == manifest.end()) {
+            files.emplace_back(file);
+            manifest.emplace(name, checksum);
+        } else if (it->second != checksum) {
+            spdlog::error("{} has changed since it was reformatted, run without --append", name);
+            std::exit(1);
+        }
+    }
+
+    if (files.empty()) {
+        spdlog::info("All patent data files have already been reformatted");
+        return;
+    }
+
+    spdlog::info("Reformatting {} of {} patent data files", files.size(), allFiles.size());
+
+    // Patents without text in their data file are only written if they are not in the store yet
+    ankerl::unordered_dense::set<std::string> writtenPublicationNumbers;
+    writtenPublicationNumbers.reserve(cpcCodesByPatent.size());
+
+    std::unique_ptr<TermDictionaryWriter> dictionary;
+    std::size_t firstShard = 0;
+
+    if (append) {
+        KeyIndex<std::uint8_t> existingIndex(outputDirectory / "index.bin");
+        for (std::uint64_t i = 0; i < existingIndex.size(); ++i) {
+            writtenPublicationNumbers.emplace(existingIndex.getKey(i));
         }
+
+        dictionary = std::make_unique<TermDictionaryWriter>(
+            outputDirectory / "terms",
+            TermDictionary(outputDirectory / "terms"));
+        firstShard = getShardDirectories(outputDirectory).size();
+    } else {
+        dictionary = std::make_unique<TermDictionaryWriter>(outputDirectory / "terms");
     }
+
+    ProgressBar progressBar(cpcCodesByPatent.size() - writtenPublicationNumbers.size(), "Processing patents");
+
+    // A quarter of the memory limit goes to the buffers of the shard writers, the rest is split evenly between DuckDB
+    // and the chunks waiting in the queue
+    // Every shard writes PATENT_FILE_COUNT files through two buffers each, with fewer shards when the quarter can't
+    // give every file buffers of at least MIN_BUFFER_SIZE
+    constexpr std::size_t MIN_BUFFER_SIZE = 1024 * 1024;
+
+    auto memoryLimit = getReformatMemoryLimit();
+    auto writerMemoryLimit = memoryLimit / 4;
+    auto buffersPerShard = PATENT_FILE_COUNT * 2;
+
+    BS::thread_pool threadPool;
+    auto shardCount = std::clamp<std::size_t>(
+        writerMemoryLimit / (buffersPerShard * MIN_BUFFER_SIZE),
+        1,
+        threadPool.get_thread_count());
+    auto bufferSize = std::clamp<std::size_t>(
+        writerMemoryLimit / (buffersPerShard * shardCount),
+        MIN_BUFFER_SIZE,
+        FileWriter::DEFAULT_BUFFER_SIZE);
+
+    {
+        std::vector<std::unique_ptr<PatentWriter>> writers;
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            writers.emplace_back(std::make_unique<PatentWriter>(
+                getShardDirectory(outputDirectory, firstShard + i),
+                *dictionary,
+                bufferSize));
+        }
+
+        BoundedQueue<std::unique_ptr<duckdb::DataChunk>> chunks((memoryLimit - writerMemoryLimit) / 2);
+
+        auto scanner = std::async(std::launch::async, [&] {
+            try {
+                scanPatentDataFiles(files, chunks, (memoryLimit - writerMemoryLimit) / 2, progressBar);
+            } catch (...) {
+                chunks.close();
+                throw;
+            }
+        });
+
+        std::vector<std::future<std::vector<std::string>>> futures;
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            futures.emplace_back(threadPool.submit_task([&, i] {
+                auto& writer = *writers[i];
+
+                std::vector<std::string> publicationNumbers;
+
+                // Nothing pops the queue anymore once a consumer fails, closing it stops the scanner instead of
+                // leaving it blocked on a full queue
+                try {
+                    std::unique_ptr<duckdb::DataChunk> chunk;
+                    while (chunks.pop(chunk)) {
+                        StringColumn publicationNumberColumn(*chunk, 0);
+                        StringColumn titleColumn(*chunk, 1);
+                        StringColumn abstractColumn(*chunk, 2);
+                        StringColumn claimsColumn(*chunk, 3);
+                        StringColumn descriptionColumn(*chunk, 4);
+
+                        for (std::size_t j = 0; j < chunk->size(); ++j) {
+                            const auto& publicationNumber = publicationNumbers.emplace_back(
+                                publicationNumberColumn.get(j));
+
+                            writer.writePatent(
+                                publicationNumber,
+                                cpcCodesByPatent.at(publicationNumber),
+                                titleColumn.get(j),
+                                abstractColumn.get(j),
+                                claimsColumn.get(j),
+                                descriptionColumn.get(j));
+                        }
+
+                        progressBar.update(chunk->size());
+                    }
+                } catch (...) {
+                    chunks.close();
+                    throw;
+                }
+
+                return publicationNumbers;
+            }));
+        }
+
+        scanner.get();
+
+        for (auto& future : futures) {
+            auto publicationNumbers = future.get();
+            writtenPublicationNumbers.insert(publicationNumbers.begin(), publicationNumbers.end());
+        }
+
+        progressBar.setDescription("Processing patents without text");
+
+        // For 93 patents there is no row in their corresponding patent data file
+        auto& writer = *writers[0];
+        for (const auto& [publicationNumber, cpcCodes] : cpcCodesByPatent) {
+            if (!writtenPublicationNumbers.contains(publicationNumber)) {
+                writer.writePatent(publicationNumber, cpcCodes, "", "", "", "");
+                progressBar.update(1);
+            }
+        }
+    }
+
+    // The dictionary is written on destruction, after the shards which added terms to it
+    dictionary.reset();
+
+    spdlog::info("Merging the indices of {} shards", firstShard + shardCount);
+    PatentWriter::mergeShards(outputDirectory, firstShard + shardCount);
+
+    writeManifest(manifestFile, manifest);
 }
 
-int main() {
+// Pass --append to only reformat the patent data files which are not in the existing store yet
+// Without it the existing store is removed first, so any other argument is rejected rather than taken as a full run
+int main(int argc, char* argv[]) {
+    if (argc > 2 || (argc == 2 && std::string(argv[1]) != "--append")) {
+        spdlog::error("Usage: {} [--append]", argv[0]);
+        std::exit(1);
+    }
+
+    bool append = argc == 2;
+
     auto cpcCodesByPatent = getCpcCodesByPatent();
-    processPatentDataFiles(cpcCodesByPatent);
+    processPatentDataFiles(cpcCodesByPatent, append);
     return 0;
 }
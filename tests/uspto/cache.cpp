@@ -0,0 +1,57 @@
+#include <cstdint>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include <uspto/cache.h>
+
+TEST(cache, loadsOnce) {
+    ConcurrentCache<std::string> cache(1024 * 1024);
+    int loads = 0;
+
+    auto load = [&] {
+        ++loads;
+        return std::string("value");
+    };
+    auto getSize = [](const std::string& value) {
+        return value.size();
+    };
+
+    EXPECT_EQ(*cache.get("key", load, getSize), "value");
+    EXPECT_EQ(*cache.get("key", load, getSize), "value");
+    EXPECT_EQ(loads, 1);
+}
+
+TEST(cache, evictsWhenFull) {
+    // Every shard has room for two entries, so the first key is long gone after loading 1000 keys
+    ConcurrentCache<std::string> cache(64 * 200);
+    int loads = 0;
+
+    auto getSize = [](const std::string& value) {
+        return value.size();
+    };
+
+    for (int i = 0; i < 1000; ++i) {
+        auto key = std::to_string(i);
+        auto value = cache.get(
+            key,
+            [&] {
+                ++loads;
+                return key;
+            },
+            getSize);
+
+        EXPECT_EQ(*value, key);
+    }
+
+    EXPECT_EQ(loads, 1000);
+
+    cache.get(
+        "0",
+        [&] {
+            ++loads;
+            return std::string("0");
+        },
+        getSize);
+    EXPECT_EQ(loads, 1001);
+}
@@ -0,0 +1,151 @@
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <uspto/files.h>
+
+TEST(files, writeAndReadKeys) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        DataWriter<std::uint8_t> writer(temporaryDirectory.path);
+
+        for (const auto& key : {"b", "c", "a", "ab"}) {
+            writer.addKey(key);
+            writer.writeString<std::uint8_t>(fmt::format("value-{}", key));
+        }
+    }
+
+    DataReader<std::uint8_t> reader(temporaryDirectory.path);
+
+    const auto& index = reader.getIndex();
+    ASSERT_EQ(index.size(), 4);
+    EXPECT_EQ(index.getKey(0), "a");
+    EXPECT_EQ(index.getKey(1), "ab");
+    EXPECT_EQ(index.getKey(2), "b");
+    EXPECT_EQ(index.getKey(3), "c");
+
+    EXPECT_EQ(index.lowerBound("aa"), 1);
+    EXPECT_EQ(index.lowerBound("d"), 4);
+    EXPECT_TRUE(index.contains("ab"));
+    EXPECT_FALSE(index.contains("d"));
+    EXPECT_THROW(index.at("d"), std::out_of_range);
+
+    EXPECT_EQ(reader.getKeyReader("a").readString<std::uint8_t>(), "value-a");
+    EXPECT_EQ(reader.getKeyReader("ab").readString<std::uint8_t>(), "value-ab");
+    EXPECT_EQ(reader.getKeyReader("b").readString<std::uint8_t>(), "value-b");
+    EXPECT_EQ(reader.getKeyReader("c").readString<std::uint8_t>(), "value-c");
+
+    std::vector<std::string> keys{"a", "ab", "b", "c"};
+    reader.sortToIndex(keys);
+    EXPECT_EQ(keys, std::vector<std::string>({"b", "c", "a", "ab"}));
+}
+
+TEST(files, writeBuffered) {
+    TemporaryDirectory temporaryDirectory;
+    auto file = temporaryDirectory.path / "data.bin";
+
+    {
+        FileWriter writer(file, 16);
+
+        for (std::uint32_t i = 0; i < 1000; ++i) {
+            EXPECT_EQ(writer.getPosition(), i * 4);
+            writer.writeScalar<std::uint32_t>(i);
+        }
+
+        writer.writeString<std::uint16_t>(std::string(100, 'x'));
+    }
+
+    FileReader reader(file);
+
+    for (std::uint32_t i = 0; i < 1000; ++i) {
+        EXPECT_EQ(reader.readScalar<std::uint32_t>(), i);
+    }
+
+    EXPECT_EQ(reader.readString<std::uint16_t>(), std::string(100, 'x'));
+    EXPECT_TRUE(reader.isEOF());
+}
+
+TEST(files, writeAndReadVarInts) {
+    TemporaryDirectory temporaryDirectory;
+    auto file = temporaryDirectory.path / "data.bin";
+
+    std::vector<std::uint64_t> values = {0, 1, 127, 128, 300, 16383, 16384, 4294967295, 18446744073709551615ULL};
+
+    {
+        FileWriter writer(file);
+
+        for (auto value : values) {
+            writer.writeVarInt(value);
+        }
+
+        EXPECT_EQ(writer.getPosition(), 1 + 1 + 1 + 2 + 2 + 2 + 3 + 5 + 10);
+    }
+
+    FileReader reader(file);
+
+    for (auto value : values) {
+        EXPECT_EQ(reader.readVarInt(), value);
+    }
+
+    EXPECT_TRUE(reader.isEOF());
+}
+
+TEST(files, writeAndReadAligned) {
+    TemporaryDirectory temporaryDirectory;
+    auto file = temporaryDirectory.path / "data.bin";
+
+    {
+        FileWriter writer(file);
+
+        writer.writeScalar<std::uint8_t>(1);
+        writer.align(32);
+        EXPECT_EQ(writer.getPosition(), 32);
+
+        writer.align(32);
+        writer.writeScalar<std::uint32_t>(2);
+    }
+
+    FileReader reader(file);
+
+    EXPECT_EQ(reader.readScalar<std::uint8_t>(), 1);
+    reader.align(32);
+    EXPECT_EQ(reader.getPosition(), 32);
+    EXPECT_EQ(reader.readScalar<std::uint32_t>(), 2);
+    EXPECT_TRUE(reader.isEOF());
+}
+
+TEST(files, writeAndReadShards) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        DataWriter<std::uint8_t> writer1(getShardDirectory(temporaryDirectory.path, 0));
+        DataWriter<std::uint8_t> writer2(getShardDirectory(temporaryDirectory.path, 1));
+
+        for (const auto& key : {"a", "d"}) {
+            writer1.addKey(key);
+            writer1.writeString<std::uint8_t>(fmt::format("value-{}", key));
+        }
+
+        for (const auto& key : {"c", "b"}) {
+            writer2.addKey(key);
+            writer2.writeString<std::uint8_t>(fmt::format("value-{}", key));
+        }
+    }
+
+    DataWriter<std::uint8_t>::mergeShards(temporaryDirectory.path, 2);
+
+    DataReader<std::uint8_t> reader(temporaryDirectory.path);
+    EXPECT_EQ(reader.getIndex().size(), 4);
+
+    for (const auto& key : {"a", "b", "c", "d"}) {
+        EXPECT_EQ(reader.getKeyReader(key).readString<std::uint8_t>(), fmt::format("value-{}", key));
+    }
+
+    std::vector<std::string> keys{"a", "b", "c", "d"};
+    reader.sortToIndex(keys);
+    EXPECT_EQ(keys, std::vector<std::string>({"a", "d", "c", "b"}));
+}
@@ -0,0 +1,225 @@
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <ankerl/unordered_dense.h>
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <uspto/files.h>
+#include <uspto/index.h>
+#include <uspto/patents.h>
+
+TEST(index, getCpcRollupTerm) {
+    EXPECT_EQ(getCpcRollupTerm("cpc:H04L9/0643", 0), "cpc:H*");
+    EXPECT_EQ(getCpcRollupTerm("cpc:H04L9/0643", 1), "cpc:H04*");
+    EXPECT_EQ(getCpcRollupTerm("cpc:H04L9/0643", 2), "cpc:H04L*");
+    EXPECT_EQ(getCpcRollupTerm("cpc:H04L9/0643", 3), "cpc:H04L9/*");
+    EXPECT_EQ(getCpcRollupTerm("cpc:Y10S", 2), "cpc:Y10S*");
+    EXPECT_EQ(getCpcRollupTerm("cpc:Y10S", 3), "");
+}
+
+TEST(index, prefixTerms) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        SearchIndexWriter writer(temporaryDirectory.path);
+
+        writer.writeIds({{"US-1-A", 0}, {"US-2-A", 1}, {"US-3-A", 2}});
+        writer.writeCounts("ti:semiconductor", {{0, 1}, {1, 2}});
+        writer.writeCounts("ti:semiconductors", {{1, 1}});
+        writer.writeCounts("ti:silicon", {{2, 1}});
+    }
+
+    SearchIndexReader reader(temporaryDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_EQ(
+        reader.readTermsWithPrefix("ti:semicond"),
+        std::vector<std::string>({"ti:semiconductor", "ti:semiconductors"}));
+
+    auto bitset = index.getTermBitset("ti:semicond*");
+    EXPECT_TRUE(bitset->contains(0));
+    EXPECT_TRUE(bitset->contains(1));
+    EXPECT_FALSE(bitset->contains(2));
+    EXPECT_EQ(index.getTermCardinality("ti:semicond*"), 2);
+    EXPECT_EQ(*index.getTermCounts("ti:semicond*"), std::vector<std::uint16_t>({1, 3}));
+    EXPECT_EQ(reader.readTermCounts("ti:semiconductor"), std::vector<std::uint16_t>({1, 2}));
+    EXPECT_EQ(index.getTermBitset("ti:s*")->cardinality(), 3);
+}
+
+TEST(index, createSearchIndex) {
+    TemporaryDirectory patentDirectory;
+    TemporaryDirectory indexDirectory;
+
+    {
+        PatentWriter writer(patentDirectory.path);
+
+        writer.writePatent("US-1-A", {"H04L9/0643"}, "Semiconductor device", "Abstract", "Claims", "Description");
+        writer.writePatent("US-2-A", {"H04L9/0643", "G06F"}, "Semiconductor wafer", "Abstract", "Claims", "Other");
+    }
+
+    PatentReader patentReader(patentDirectory.path);
+    createSearchIndex({"US-1-A", "US-2-A"}, indexDirectory.path, patentReader, false);
+
+    EXPECT_FALSE(std::filesystem::exists(indexDirectory.path / "runs"));
+
+    SearchIndexReader reader(indexDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_EQ(index.getPatentCount(), 2);
+    EXPECT_EQ(index.getTermCardinality("ti:semiconductor"), 2);
+    EXPECT_EQ(index.getTermCardinality("ti:wafer"), 1);
+    EXPECT_EQ(index.getTermCardinality("cpc:G06F"), 1);
+    EXPECT_EQ(index.getTermCardinality("cpc:H04L*"), 2);
+    EXPECT_DOUBLE_EQ(index.getTermIdf("ti:wafer"), getIdf(2, 1));
+    EXPECT_DOUBLE_EQ(index.getTermIdf("cpc:H04L*"), getIdf(2, 2));
+    EXPECT_TRUE(reader.containsTerm("clm:claims"));
+    EXPECT_FALSE(reader.containsTerm("detd:description"));
+}
+
+TEST(index, estimateCardinality) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        SearchIndexWriter writer(temporaryDirectory.path);
+
+        ankerl::unordered_dense::map<std::string, std::uint32_t> ids;
+        ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> firstCounts;
+        ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> secondCounts;
+
+        for (std::uint32_t i = 0; i < 15000; ++i) {
+            ids.emplace(fmt::format("US-{}-A", i), i);
+
+            if (i < 10000) {
+                firstCounts.emplace(i, 1);
+            }
+
+            if (i >= 5000) {
+                secondCounts.emplace(i, 1);
+            }
+        }
+
+        writer.writeIds(ids);
+        writer.writeCounts("ti:first", firstCounts);
+        writer.writeCounts("ti:second", secondCounts);
+        writer.writeCounts("ti:rare", {{1, 1}, {5001, 2}, {9999, 1}});
+        writer.writeCounts("ti:other", {{5001, 1}, {12000, 1}});
+    }
+
+    SearchIndexReader reader(temporaryDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_DOUBLE_EQ(index.estimateCardinality({"ti:first"}), 10000);
+    EXPECT_DOUBLE_EQ(index.estimateCardinality({"ti:rare", "ti:other"}), 1);
+    EXPECT_NEAR(index.estimateCardinality({"ti:first", "ti:second"}), 5000, 2000);
+    EXPECT_LE(index.estimateCardinality({"ti:first", "ti:rare"}), 3);
+}
+
+TEST(index, prefixTermsWithRollups) {
+    TemporaryDirectory patentDirectory;
+    TemporaryDirectory indexDirectory;
+
+    {
+        PatentWriter writer(patentDirectory.path);
+
+        writer.writePatent("US-1-A", {"H04L9/0643"}, "", "", "", "");
+        writer.writePatent("US-2-A", {"H04L9/0643", "H04L12/10"}, "", "", "", "");
+    }
+
+    PatentReader patentReader(patentDirectory.path);
+    createSearchIndex({"US-1-A", "US-2-A"}, indexDirectory.path, patentReader, false);
+
+    SearchIndexReader reader(indexDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_EQ(reader.readTermsWithPrefix("cpc:H04L9"), std::vector<std::string>({"cpc:H04L9/0643"}));
+
+    EXPECT_EQ(*index.getTermCounts("cpc:H04L9*"), std::vector<std::uint16_t>({1, 1}));
+    EXPECT_EQ(*index.getTermCounts("cpc:H04L*"), std::vector<std::uint16_t>({1, 2}));
+    EXPECT_EQ(*index.getTermCounts("cpc:H0*"), std::vector<std::uint16_t>({1, 2}));
+    EXPECT_EQ(index.getTermCardinality("cpc:H0*"), 2);
+}
+
+TEST(index, prefixCountsSaturate) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        SearchIndexWriter writer(temporaryDirectory.path);
+
+        writer.writeIds({{"US-1-A", 0}, {"US-2-A", 1}});
+        writer.writeCounts("detd:about", {{0, 40000}, {1, 1}});
+        writer.writeCounts("detd:above", {{0, 40000}, {1, 2}});
+    }
+
+    SearchIndexReader reader(temporaryDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_EQ(*index.getTermCounts("detd:a*"), std::vector<std::uint16_t>({65535, 3}));
+}
+
+TEST(index, estimateCardinalityWithSmallOverlap) {
+    TemporaryDirectory temporaryDirectory;
+
+    {
+        SearchIndexWriter writer(temporaryDirectory.path);
+
+        ankerl::unordered_dense::map<std::string, std::uint32_t> ids;
+        ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> firstCounts;
+        ankerl::unordered_dense::map<std::uint32_t, std::uint16_t> secondCounts;
+
+        // Both terms occur in 100,000 patents, 500 of which they share
+        for (std::uint32_t i = 0; i < 199500; ++i) {
+            ids.emplace(fmt::format("US-{}-A", i), i);
+
+            if (i < 100000) {
+                firstCounts.emplace(i, 1);
+            }
+
+            if (i >= 99500) {
+                secondCounts.emplace(i, 1);
+            }
+        }
+
+        writer.writeIds(ids);
+        writer.writeCounts("ti:first", firstCounts);
+        writer.writeCounts("ti:second", secondCounts);
+    }
+
+    SearchIndexReader reader(temporaryDirectory.path);
+    SearchIndex index(reader);
+
+    // The sample of the union contains fewer than MIN_SHARED_HASHES of the shared patents, which would estimate the
+    // overlap from noise or as 0, so the terms are treated as independent instead
+    EXPECT_DOUBLE_EQ(
+        index.estimateCardinality({"ti:first", "ti:second"}),
+        index.getTermSelectivity("ti:first") * index.getTermSelectivity("ti:second") * 199500);
+
+    EXPECT_GE(index.estimateCardinality({"ti:first", "ti:second"}, 60000), 60000);
+    EXPECT_GT(index.estimateSelectivity({"ti:first", "ti:second"}), 0);
+}
+
+TEST(index, duplicateCpcCodes) {
+    TemporaryDirectory patentDirectory;
+    TemporaryDirectory indexDirectory;
+
+    {
+        PatentWriter writer(patentDirectory.path);
+
+        writer.writePatent("US-1-A", {"A01B1/00", "A01B1/00"}, "", "", "", "");
+        writer.writePatent("US-2-A", {"A01B1/00"}, "", "", "", "");
+    }
+
+    PatentReader patentReader(patentDirectory.path);
+    EXPECT_EQ(patentReader.readTerms("US-1-A", TermCategory::Cpc), std::vector<std::string>({"cpc:A01B1/00"}));
+
+    createSearchIndex({"US-1-A", "US-2-A"}, indexDirectory.path, patentReader, false);
+
+    SearchIndexReader reader(indexDirectory.path);
+    SearchIndex index(reader);
+
+    EXPECT_EQ(index.getTermCardinality("cpc:A01B1/00"), 2);
+    EXPECT_EQ(*index.getTermCounts("cpc:A01B1/00"), std::vector<std::uint16_t>({1, 1}));
+    EXPECT_EQ(*index.getTermCounts("cpc:A01B*"), std::vector<std::uint16_t>({1, 1}));
+}
@@ -238,6 +238,7 @@ TEST(patents, writeAndReadPatentData) {
     }
 
     PatentReader reader(temporaryDirectory.path);
+    reader.prefetch({"US-1-A"}, TermCategory::Title | TermCategory::Description);
 
     auto allTerms = reader.readTermsWithCounts(
         "US-1-A",
@@ -260,4 +261,17 @@ TEST(patents, writeAndReadPatentData) {
 
     auto titleTerms = reader.readTerms("US-1-A", TermCategory::Title);
     EXPECT_EQ(titleTerms, std::vector<std::string>({"ti:title"}));
+
+    const auto& dictionary = reader.getDictionary();
+    EXPECT_EQ(dictionary.size(), 8);
+    EXPECT_EQ(dictionary.getTerm(dictionary.getId("ti:title")), "ti:title");
+    EXPECT_FALSE(dictionary.contains("ti:missing"));
+
+    PatentReader coldReader(temporaryDirectory.path, static_cast<TermCategory::TermCategory>(0));
+    EXPECT_EQ(
+        coldReader.readTermsWithCounts("US-1-A", TermCategory::Title),
+        reader.readTermsWithCounts("US-1-A", TermCategory::Title));
+
+    auto titleIds = reader.readTermIdsWithCounts("US-1-A", TermCategory::Title);
+    EXPECT_EQ(titleIds, (std::vector<std::pair<std::uint32_t, std::uint16_t>>({{dictionary.getId("ti:title"), 2}})));
 }
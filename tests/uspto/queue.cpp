@@ -0,0 +1,66 @@
+#include <cstddef>
+#include <future>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <uspto/queue.h>
+
+TEST(queue, pushAndPop) {
+    BoundedQueue<int> queue(2);
+
+    auto producer = std::async(std::launch::async, [&] {
+        for (int i = 0; i < 100; ++i) {
+            queue.push(i);
+        }
+
+        queue.close();
+    });
+
+    std::vector<int> items;
+
+    int item;
+    while (queue.pop(item)) {
+        items.emplace_back(item);
+    }
+
+    producer.get();
+
+    ASSERT_EQ(items.size(), 100);
+    for (std::size_t i = 0; i < items.size(); ++i) {
+        EXPECT_EQ(items[i], i);
+    }
+}
+
+TEST(queue, acceptsHeavyItemWhenEmpty) {
+    BoundedQueue<int> queue(10);
+
+    queue.push(1, 100);
+    queue.close();
+
+    int item;
+    EXPECT_TRUE(queue.pop(item));
+    EXPECT_EQ(item, 1);
+    EXPECT_FALSE(queue.pop(item));
+}
+
+TEST(queue, closeUnblocksProducer) {
+    BoundedQueue<int> queue(1);
+
+    auto producer = std::async(std::launch::async, [&] {
+        int pushed = 0;
+        while (queue.push(pushed)) {
+            ++pushed;
+        }
+
+        return pushed;
+    });
+
+    int item;
+    EXPECT_TRUE(queue.pop(item));
+
+    // A failing consumer closes the queue without draining it
+    queue.close();
+
+    EXPECT_GE(producer.get(), 1);
+}